@@ -0,0 +1,328 @@
+/*
+Emulation steps shared by vrc7_sound.c and the C++ engine in vrc7_sound.hpp. This header is not part of the public API.
+
+The functions only work on plain values, so both implementations can keep their own state layout.
+
+-- vrc7_core_make_tables:				Fills the logsin, fast_exp and env_inc_masks lookup tables.
+-- vrc7_core_count_trailing_zeros:		Number of trailing zero bits of a value that is not 0.
+-- vrc7_core_calc_vibrato:				Vibrato offset of the phase increment, before the multiplier is applied.
+-- vrc7_core_lfo_step:					Combination of the vibrato and tremolo bits that the slots depend on.
+-- vrc7_core_envelope_rate_high:		High envelope rate of a slot in an envelope stage.
+-- vrc7_core_envelope_inc:				Envelope increment of a slot for the current tick.
+-- vrc7_core_envelope_stage:			Envelope stage changes of a slot for the current tick.
+-- vrc7_core_rhythm_phase:				Phase of the HH, SD and CYM rhythm instruments.
+-- vrc7_core_operator:					Output of an operator.
+-- vrc7_core_update_fmam:				Advances the vibrato counter and the tremolo value.
+-- vrc7_core_update_envelope_counters:	Advances the envelope counters.
+*/
+
+#ifndef VRC7_CORE_H
+#define VRC7_CORE_H
+
+#include "vrc7_sound.h"
+
+#include <math.h>
+
+#ifdef _MSC_VER
+#include <intrin.h>
+#endif
+
+#define VRC7_LOGSIN_TABLE_LEN 256
+#define VRC7_EXP_TABLE_LEN 256
+#define VRC7_FAST_EXP_TABLE_LEN 4096
+
+//Index into env_inc_masks: rate_high (bits 0-3), clock_envelope (4), env_table (5), mini_zero (6), mini_odd (7), env_enabled (8)
+#define VRC7_ENV_INC_INDEX_LEN 512
+
+#define VRC7_ENV_PERCUSSIVE_RATE 7
+#define VRC7_ENV_SUSTAINED_RATE 5
+#define VRC7_ENV_DAMPING_RATE 12
+
+enum vrc7_env_stages {
+	VRC7_ENV_ATTACK=0,	//Attack phase
+	VRC7_ENV_DECAY,		//Above sustain level
+	VRC7_ENV_RELEASE,	//Below sustain level, trigger on
+	VRC7_ENV_DAMPING	//trigger off
+};
+
+/*
+Selects the envelope increments for one combination of conditions: inc1 (bit 0), inc2 (1), inc3 (2), inc4 (3).
+*/
+static inline uint8_t vrc7_core_env_inc_mask(uint32_t index) {
+	uint32_t rate_high = index & 0xf;
+	bool clock_envelope = (index & 0x10) != 0;
+	bool env_table = (index & 0x20) != 0;
+	bool mini_zero = (index & 0x40) != 0;
+	bool mini_odd = (index & 0x80) != 0;
+	bool env_enabled = (index & 0x100) != 0;
+
+	uint8_t mask = 0;
+	if (clock_envelope || (!env_table && rate_high == 12))
+		mask |= 0x8;
+
+	if ((!env_table && rate_high == 13) || (env_table && rate_high == 12))
+		mask |= 0x4;
+
+	if ((clock_envelope && mini_zero && env_enabled)
+			|| (rate_high == 14 && !env_table)
+			|| (rate_high == 13 && env_table)
+			|| (rate_high == 13 && !env_table && mini_odd && env_enabled)
+			|| (rate_high == 12 && !env_table && mini_zero && env_enabled)
+			|| (rate_high == 12 && env_table && mini_odd && env_enabled))
+		mask |= 0x2;
+
+	if (rate_high == 15 || (rate_high == 14 && env_table))
+		mask |= 0x1;
+
+	return mask;
+}
+
+static inline void vrc7_core_make_tables(uint32_t *logsin, uint16_t *fast_exp, uint8_t *env_inc_masks) {
+	const double pi = 3.141592653589793238462643383279502884197169399;
+	int exp[VRC7_EXP_TABLE_LEN];
+
+	for (int i = 0; i < VRC7_LOGSIN_TABLE_LEN; i++) {
+		logsin[i] = (int)round(-log2(sin(((double)i + 0.5)*pi / 512.0))*256.0);
+		exp[i] = (int)round((pow(2, (double)i / 256.0) - 1) * 1024);
+	}
+
+	//Create a larger lookup table to speed up computation of the exp value at the expense of more memory
+	for (uint32_t i = 0; i < VRC7_FAST_EXP_TABLE_LEN; i++) {
+		int shift = i >> 8;
+		int index = ~i & 0xff;
+		if (shift > 12) {
+			fast_exp[i] = 0;
+		}else {
+			int linear = exp[index];
+			linear += 1024;
+			linear >>= shift;
+			fast_exp[i] = linear & 0x7ff;
+		}
+	}
+
+	for (uint32_t i = 0; i < VRC7_ENV_INC_INDEX_LEN; i++) {
+		env_inc_masks[i] = vrc7_core_env_inc_mask(i);
+	}
+}
+
+static inline uint32_t vrc7_core_count_trailing_zeros(uint32_t value) {
+	//value is never 0
+#if defined(_MSC_VER)
+	unsigned long index;
+	_BitScanForward(&index, value);
+	return index;
+#elif defined(__GNUC__) || defined(__clang__)
+	return (uint32_t)__builtin_ctz(value);
+#else
+	uint32_t count = 0;
+	while ((value & 1) == 0) {
+		value >>= 1;
+		count++;
+	}
+	return count;
+#endif
+}
+
+static inline int32_t vrc7_core_calc_vibrato(uint32_t vibrato_counter, uint32_t fNum, uint32_t octave) {
+	int32_t vib_value = 0;
+	if (vibrato_counter & 1 << 11)
+		vib_value = fNum >> 6;
+	else if (vibrato_counter & 1 << 10)
+		vib_value = fNum >> 7;
+	if (vibrato_counter & 1 << 12)
+		vib_value = -vib_value;
+	return vib_value<<(octave+1);
+}
+
+/*
+The vibrato only depends on bits 10-12 of the vibrato counter and the tremolo only uses the upper bits of its value,
+so values derived from them only have to be updated when this changes.
+*/
+static inline uint32_t vrc7_core_lfo_step(uint32_t vibrato_counter, uint32_t tremolo_value) {
+	return ((vibrato_counter >> 10) & 0x7) | (tremolo_value >> 3) << 3;
+}
+
+/*
+key_scale is the key rate scaling value of the slot, key whether the slot is keyed on and sustain the sustain bit of the channel.
+*/
+static inline uint32_t vrc7_core_envelope_rate_high(const struct vrc7_patch *patch, uint32_t type, uint32_t key_scale, uint32_t env_stage, bool key, bool sustain) {
+	//Set rate based on current envelope stage
+	uint32_t rate_high = 0;
+	switch (env_stage) {
+	case VRC7_ENV_ATTACK:
+		rate_high = patch->attack_rate[type] + key_scale;
+		break;
+	case VRC7_ENV_DECAY:
+		rate_high = patch->decay_rate[type] + key_scale;
+		break;
+	case VRC7_ENV_RELEASE:
+		if (patch->sustained[type])	//Envelope sustaining
+			rate_high = 0;
+		else
+			rate_high = patch->release_rate[type] + key_scale;
+		break;
+	case VRC7_ENV_DAMPING:
+		if (key)	//Key on, get envelope ready
+			rate_high = VRC7_ENV_DAMPING_RATE + key_scale;
+		else {
+			if (sustain)
+				rate_high = VRC7_ENV_SUSTAINED_RATE + key_scale;
+			else if (!patch->sustained[type])
+				rate_high = VRC7_ENV_PERCUSSIVE_RATE + key_scale;
+			else
+				rate_high = patch->release_rate[type] + key_scale;	//Non-percussive release
+		}
+		break;
+	}
+	return rate_high < 15 ? rate_high : 15;
+}
+
+static inline uint32_t vrc7_core_envelope_inc(const uint8_t *env_inc_masks, uint32_t rate_high, uint32_t rate_low, uint32_t env_stage, uint32_t env_value, bool env_enabled,
+		uint32_t zero_count, uint32_t envelope_counter, uint32_t mini_counter) {
+	static const uint8_t ENV_TABLE[4][4] = {
+		{0,0,0,0},
+		{1,0,0,0},
+		{1,0,1,0},
+		{1,1,1,0},
+	};
+
+	//Which of rate_low's bits allow the envelope to be clocked when rate_high + zero_count is 12, 13 or 14 (bits 0-2)
+	static const uint32_t ENV_CLOCK_MASK[4] = { 0x1, 0x5, 0x3, 0x7 };
+
+	//Check whether to update the envelope 'naturally'. Rates 1-11 are clocked when rate_high + zero_count is 12,
+	//or 13 and 14 if the matching bit of rate_low is set.
+	uint32_t clock_offset = rate_high + zero_count - 12;
+	uint32_t clock_envelope = (ENV_CLOCK_MASK[rate_low] >> (clock_offset & 3)) & (clock_offset < 3) & (rate_high - 1 < 11);
+
+	//Get various flags
+	uint32_t env_table = ENV_TABLE[rate_low][envelope_counter & 3];
+	uint32_t mini_zero = mini_counter == 0;
+	uint32_t mini_odd = (mini_counter & 1) == 0;
+
+	//Setup the four different increment values
+	uint32_t attack = 0 - (uint32_t)(env_stage == VRC7_ENV_ATTACK);
+	uint32_t distance = (~env_value + 1) & attack;
+	uint32_t inc1 = distance >> 1 | (uint32_t)env_enabled << 1;
+	uint32_t inc2 = distance >> 2 | (uint32_t)env_enabled;
+	uint32_t inc3 = distance >> 3;
+	uint32_t inc4 = distance >> 4;
+
+	//Compute envelope increment from the precalculated selection
+	uint32_t mask = env_inc_masks[rate_high | clock_envelope << 4 | env_table << 5 | mini_zero << 6 | mini_odd << 7 | (uint32_t)env_enabled << 8];
+	return (inc1 & (0 - (mask & 1)))
+		| (inc2 & (0 - (mask >> 1 & 1)))
+		| (inc3 & (0 - (mask >> 2 & 1)))
+		| (inc4 & (0 - (mask >> 3 & 1)));
+}
+
+/*
+Returns the new envelope stage and updates env_value and env_enabled. rate_high is the rate before the update, restart whether the
+envelope was keyed on and hold whether the slot keeps its envelope when it is keyed off (sustained modulators).
+The high rate has to be recalculated when the stage changed or the envelope was restarted.
+*/
+static inline uint32_t vrc7_core_envelope_stage(uint32_t env_stage, uint32_t rate_high, uint32_t *env_value, bool *env_enabled, bool restart,
+		uint32_t sustain_level, bool key, bool hold) {
+	//Restart envelope
+	if (restart) {
+		*env_enabled = true;
+		env_stage = VRC7_ENV_DAMPING;
+	}
+
+	//Skip attack phase when rate is 15
+	if (env_stage == VRC7_ENV_ATTACK && rate_high == 15) {
+		*env_value = 0;
+		env_stage = VRC7_ENV_DECAY;
+	}
+
+	//Enter decay phase when envelope peak is reached
+	if (env_stage == VRC7_ENV_ATTACK && *env_value == 0)
+		env_stage = VRC7_ENV_DECAY;
+
+	//Exit damping phase when value is low enough
+	if (env_stage == VRC7_ENV_DAMPING && *env_value >= 0x7c)
+		env_stage = VRC7_ENV_ATTACK;
+
+	//Check if sustain level has been reached
+	if (env_stage == VRC7_ENV_DECAY && *env_value >> 3 == sustain_level)
+		env_stage = VRC7_ENV_RELEASE;
+
+	//Release envelope when trigger bit is 0
+	if (env_stage != VRC7_ENV_DAMPING && !key && !hold) {
+		env_stage = VRC7_ENV_DAMPING;
+		*env_enabled = true;
+	}
+
+	//Stop incrementing envelope during the RELEASE/DAMPING phase when the value gets too big
+	if (*env_enabled && *env_value >= 0x7c && (env_stage == VRC7_ENV_RELEASE || env_stage == VRC7_ENV_DAMPING))
+		*env_enabled = false;
+
+	return env_stage;
+}
+
+/*
+The phase of HH, SD and CYM is generated from the phases of HH (channel 7 modulator) and CYM (channel 8 carrier) and the noise generator.
+ch and type select the instrument and have to be one of those three.
+*/
+static inline uint32_t vrc7_core_rhythm_phase(uint32_t hh_phase, uint32_t cym_phase, uint32_t noise, uint32_t ch, uint32_t type) {
+	uint32_t hh = (hh_phase >> 9) & 0x3ff;
+	uint32_t cym = (cym_phase >> 9) & 0x3ff;
+	uint32_t rm_xor = ((hh >> 2 ^ hh >> 7) | (hh >> 3 ^ cym >> 5) | (cym >> 3 ^ cym >> 5)) & 1;
+	noise &= 1;
+
+	if (ch == 7 && type == MODULATOR) {		//High hat
+		return (rm_xor << 9) | ((rm_xor ^ noise) ? 0xd0 : 0x34);
+	}
+	else if (ch == 7) {						//Snare drum
+		uint32_t hh_bit8 = (hh >> 8) & 1;
+		return (hh_bit8 << 9) | ((hh_bit8 ^ noise) << 8);
+	}
+	else {									//Top cymbal
+		return (rm_xor << 9) | 0x80;
+	}
+}
+
+static inline int32_t vrc7_core_operator(const uint32_t *logsin, const uint16_t *fast_exp, uint32_t phase, int32_t mod_phase, uint32_t volume, bool rect) {
+	//Calculate final phase value
+	phase = ((phase >> 9) + mod_phase) & 0x3ff;
+
+	//Calculate logsin value
+	uint32_t logsin_val = logsin[((phase & 0x100) ? ~phase : phase) & 0xff];
+	logsin_val += volume << 4;
+
+	//Set output to 0 if value is too big
+	int32_t output = logsin_val >= (1 << 12) ? 0 : fast_exp[logsin_val];
+
+	//Invert or zero output when sign bit is set
+	if (phase & 0x200) {
+		if (rect)
+			output = 0;
+		else
+			output = ~output;
+	}
+	return output;
+}
+
+static inline void vrc7_core_update_fmam(uint32_t *vibrato_counter, uint32_t *tremolo_value, int32_t *tremolo_inc) {
+	//Update vibrato counter
+	(*vibrato_counter)++;
+
+	//Update tremolo value/increment
+	if ((*vibrato_counter & 0x3f) == 0) {
+		*tremolo_value += *tremolo_inc;
+		if (*tremolo_value >= 0x69 || *tremolo_value <= 0)
+			*tremolo_inc *= -1;
+	}
+}
+
+static inline void vrc7_core_update_envelope_counters(uint32_t *mini_counter, uint32_t *envelope_counter, uint32_t *zero_count) {
+	//Update envelope counters
+	*mini_counter = (*mini_counter + 1) & 3;
+	if (*mini_counter == 0)
+		(*envelope_counter)++;
+
+	//Update zero count: one more than the trailing zeros of the envelope counter, or 0 if there are 13 or more
+	uint32_t trailing_zeros = vrc7_core_count_trailing_zeros(*envelope_counter | 1 << 13);
+	*zero_count = trailing_zeros < 13 ? trailing_zeros + 1 : 0;
+}
+
+#endif
@@ -0,0 +1,118 @@
+/*
+Quality governor for real-time rendering. See vrc7_governor.h.
+*/
+
+//clock_gettime is only declared for POSIX sources
+#if !defined(_WIN32) && !defined(_POSIX_C_SOURCE)
+#define _POSIX_C_SOURCE 200112L
+#endif
+
+#include "vrc7_governor.h"
+#include "vrc7_platform.h"
+
+#include <stdlib.h>
+
+//Weights of a new block in the smoothed load. Rising load is followed quickly, so an overload is handled before the output runs dry.
+#define LOAD_RISE 0.5
+#define LOAD_FALL 0.125
+
+/*
+Configures the chip for the current level, starting from the full quality configuration.
+*/
+static void apply_level(struct vrc7_governor *governor) {
+	struct vrc7_sound *vrc7_s = governor->vrc7_s;
+	int level = governor->level;
+
+	if (level >= VRC7_QUALITY_FAST_FILTER && governor->filter == vrc7_filter_lagrange_point)
+		vrc7_s->filter = vrc7_filter_lagrange_point_fast;
+	else
+		vrc7_s->filter = governor->filter;
+	vrc7_s->mono_mode = level >= VRC7_QUALITY_MONO ? VRC7_MONO_ON : governor->mono_mode;
+	vrc7_s->skip_idle_channels = level >= VRC7_QUALITY_SKIP_IDLE || governor->skip_idle_channels;
+}
+
+static void change_level(struct vrc7_governor *governor, int level, double load) {
+	int old_level = governor->level;
+	governor->hold = governor->hold_blocks;
+	if (level == old_level)
+		return;
+
+	governor->level = level;
+	governor->changes++;
+	apply_level(governor);
+	if (governor->callback)
+		governor->callback(governor->user, old_level, level, load);
+}
+
+VRC7SOUND_API struct vrc7_governor *vrc7_governor_new(struct vrc7_sound *vrc7_s) {
+	struct vrc7_governor *governor = (struct vrc7_governor *) calloc(1, sizeof(struct vrc7_governor));
+	if (!governor)
+		return NULL;
+
+	governor->down_load = 0.8;
+	governor->up_load = 0.4;
+	governor->hold_blocks = 32;
+	governor->max_level = VRC7_QUALITY_SKIP_IDLE;
+	governor->level = VRC7_QUALITY_FULL;
+	governor->vrc7_s = vrc7_s;
+	vrc7_governor_attach(governor);
+	return governor;
+}
+
+VRC7SOUND_API void vrc7_governor_delete(struct vrc7_governor *governor) {
+	free(governor);
+}
+
+VRC7SOUND_API void vrc7_governor_attach(struct vrc7_governor *governor) {
+	governor->filter = governor->vrc7_s->filter;
+	governor->mono_mode = governor->vrc7_s->mono_mode;
+	governor->skip_idle_channels = governor->vrc7_s->skip_idle_channels;
+	apply_level(governor);
+}
+
+VRC7SOUND_API void vrc7_governor_set_level(struct vrc7_governor *governor, int level) {
+	if (level < VRC7_QUALITY_FULL)
+		level = VRC7_QUALITY_FULL;
+	if (level >= VRC7_QUALITY_LEVELS)
+		level = VRC7_QUALITY_LEVELS - 1;
+	change_level(governor, level, 0.0);
+}
+
+VRC7SOUND_API void vrc7_governor_begin(struct vrc7_governor *governor) {
+	governor->block_start = vrc7_time_now();
+}
+
+VRC7SOUND_API void vrc7_governor_end(struct vrc7_governor *governor, uint32_t frames) {
+	double render_seconds = vrc7_time_now() - governor->block_start;
+	vrc7_governor_update(governor, render_seconds, frames / governor->vrc7_s->sample_rate);
+}
+
+VRC7SOUND_API void vrc7_governor_update(struct vrc7_governor *governor, double render_seconds, double block_seconds) {
+	if (block_seconds <= 0.0)
+		return;
+
+	double load = render_seconds / block_seconds;
+	governor->load += (load - governor->load) * (load > governor->load ? LOAD_RISE : LOAD_FALL);
+
+	int max_level = governor->max_level;
+	if (max_level < VRC7_QUALITY_FULL)
+		max_level = VRC7_QUALITY_FULL;
+	if (max_level >= VRC7_QUALITY_LEVELS)
+		max_level = VRC7_QUALITY_LEVELS - 1;
+
+	//max_level may have been lowered below the current level
+	if (governor->level > max_level) {
+		change_level(governor, max_level, governor->load);
+		return;
+	}
+
+	if (governor->hold > 0) {
+		governor->hold--;
+		return;
+	}
+
+	if (governor->load > governor->down_load && governor->level < max_level)
+		change_level(governor, governor->level + 1, governor->load);
+	else if (governor->load < governor->up_load && governor->level > VRC7_QUALITY_FULL)
+		change_level(governor, governor->level - 1, governor->load);
+}
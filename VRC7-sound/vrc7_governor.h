@@ -0,0 +1,123 @@
+/*
+Quality governor for real-time rendering with vrc7_sound.
+
+Measures how long each block of samples takes to render compared to how long it takes to play. When rendering gets too close to real time,
+the governor switches the chip to a cheaper configuration, one level at a time (see enum vrc7_quality_levels). When there is enough
+headroom again, it goes back up. Every change of level is reported through a callback.
+
+Wrap the rendering of each block in vrc7_governor_begin and vrc7_governor_end, or measure the time yourself and pass it to
+vrc7_governor_update.
+
+The governor owns filter, mono_mode and skip_idle_channels of the chip. To change them, set them to the full quality configuration and
+call vrc7_governor_attach.
+*/
+
+#ifndef VRC7_GOVERNOR_H
+#define VRC7_GOVERNOR_H
+
+#include "vrc7_sound.h"
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+/*
+Each level includes the savings of the levels before it.
+-- VRC7_QUALITY_FULL:			The configuration the chip had when the governor was attached.
+-- VRC7_QUALITY_FAST_FILTER:	vrc7_filter_lagrange_point is replaced by vrc7_filter_lagrange_point_fast.
+-- VRC7_QUALITY_MONO:			mono_mode is set to VRC7_MONO_ON, which halves the work of the mixer and the filter.
+-- VRC7_QUALITY_SKIP_IDLE:		skip_idle_channels is set, so channels that have finished their release are not emulated.
+*/
+enum vrc7_quality_levels {
+	VRC7_QUALITY_FULL=0,
+	VRC7_QUALITY_FAST_FILTER,
+	VRC7_QUALITY_MONO,
+	VRC7_QUALITY_SKIP_IDLE,
+
+	VRC7_QUALITY_LEVELS
+};
+
+/*
+Called after the governor changed the level of the chip. load is the smoothed load that caused the change, or 0 for vrc7_governor_set_level.
+*/
+typedef void(*vrc7_governor_callback)(void *user, int old_level, int new_level, double load);
+
+/*
+-- down_load:		Load (render time / play time) above which the level is lowered. The default is 0.8.
+-- up_load:			Load below which the level is raised again. The default is 0.4. Keep this well below down_load: going up makes
+					rendering more expensive, so the load rises again.
+-- hold_blocks:		Number of blocks to wait after a change before the next one, so the load can settle. The default is 32.
+-- max_level:		Lowest quality the governor may go down to. The default is VRC7_QUALITY_SKIP_IDLE.
+-- callback:		Called on every change of level. The default is NULL.
+-- user:			Passed to callback.
+
+-- level:			Current level, see enum vrc7_quality_levels.
+-- load:			Smoothed load of the last blocks.
+-- changes:			Number of level changes so far.
+*/
+struct vrc7_governor {
+	//Read & Write:
+	double down_load;
+	double up_load;
+	uint32_t hold_blocks;
+	int max_level;
+	vrc7_governor_callback callback;
+	void *user;
+
+	//Read only:
+	int level;
+	double load;
+	uint32_t changes;
+
+	//private:
+	struct vrc7_sound *vrc7_s;
+	void(*filter)(struct vrc7_sound *vrc7_s);
+	int mono_mode;
+	bool skip_idle_channels;
+	uint32_t hold;
+	double block_start;
+};
+
+/*
+Creates a governor for vrc7_s and remembers its filter, mono_mode and skip_idle_channels as the full quality configuration.
+Returns NULL if the allocation failed.
+*/
+VRC7SOUND_API struct vrc7_governor *vrc7_governor_new(struct vrc7_sound *vrc7_s);
+
+/*
+Deletes a governor. The chip keeps the configuration of the current level, call vrc7_governor_set_level with VRC7_QUALITY_FULL first
+to restore the full quality configuration.
+*/
+VRC7SOUND_API void vrc7_governor_delete(struct vrc7_governor *governor);
+
+/*
+Takes the current filter, mono_mode and skip_idle_channels of the chip as the new full quality configuration and applies the
+current level on top of it.
+*/
+VRC7SOUND_API void vrc7_governor_attach(struct vrc7_governor *governor);
+
+/*
+Sets the level directly and restarts the hold time. Calls the callback if the level changed.
+*/
+VRC7SOUND_API void vrc7_governor_set_level(struct vrc7_governor *governor, int level);
+
+/*
+Starts timing a block.
+*/
+VRC7SOUND_API void vrc7_governor_begin(struct vrc7_governor *governor);
+
+/*
+Stops timing a block of frames samples at the sample rate of the chip and updates the level.
+*/
+VRC7SOUND_API void vrc7_governor_end(struct vrc7_governor *governor, uint32_t frames);
+
+/*
+Updates the level from a block that took render_seconds to render and plays for block_seconds.
+*/
+VRC7SOUND_API void vrc7_governor_update(struct vrc7_governor *governor, double render_seconds, double block_seconds);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif
@@ -0,0 +1,109 @@
+/*
+Keyframe index for random access into register logs. See vrc7_index.h.
+*/
+
+//posix_memalign is only declared for POSIX sources
+#if !defined(_WIN32) && !defined(_POSIX_C_SOURCE)
+#define _POSIX_C_SOURCE 200112L
+#endif
+
+#include "vrc7_index.h"
+#include "vrc7_platform.h"
+
+#include <stdlib.h>
+#include <string.h>
+
+typedef char keyframe_size_check[sizeof(struct vrc7_keyframe) % 64 == 0 ? 1 : -1];
+typedef char index_header_size_check[sizeof(struct vrc7_index_header) == 64 ? 1 : -1];
+
+static inline const struct vrc7_keyframe *get_keyframes(const struct vrc7_index_header *index) {
+	return (const struct vrc7_keyframe *)(index + 1);
+}
+
+static size_t index_size(uint32_t count) {
+	return sizeof(struct vrc7_index_header) + (size_t)count * sizeof(struct vrc7_keyframe);
+}
+
+VRC7SOUND_API struct vrc7_index_builder *vrc7_index_builder_new(uint64_t interval_ticks) {
+	struct vrc7_index_builder *builder = (struct vrc7_index_builder *) calloc(1, sizeof(struct vrc7_index_builder));
+	if (!builder)
+		return NULL;
+
+	builder->index = (struct vrc7_index_header *) vrc7_aligned_alloc(index_size(0));
+	if (!builder->index) {
+		free(builder);
+		return NULL;
+	}
+
+	memset(builder->index, 0, sizeof(struct vrc7_index_header));
+	builder->index->magic = VRC7_INDEX_MAGIC;
+	builder->index->version = VRC7_INDEX_VERSION;
+	builder->index->keyframe_size = sizeof(struct vrc7_keyframe);
+	builder->index->interval_ticks = interval_ticks > 0 ? interval_ticks : 1;
+	return builder;
+}
+
+VRC7SOUND_API void vrc7_index_builder_delete(struct vrc7_index_builder *builder) {
+	vrc7_aligned_free(builder->index);
+	free(builder);
+}
+
+VRC7SOUND_API bool vrc7_index_builder_add(struct vrc7_index_builder *builder, const struct vrc7_sound *vrc7_s, uint64_t offset) {
+	if (vrc7_s->tick_count < builder->next_tick)
+		return true;
+
+	struct vrc7_index_header *index = builder->index;
+	if (index->count == builder->capacity) {
+		//Grow by doubling. The aligned allocators have no realloc, so copy by hand.
+		size_t capacity = builder->capacity ? builder->capacity * 2 : 64;
+		struct vrc7_index_header *grown = (struct vrc7_index_header *) vrc7_aligned_alloc(index_size((uint32_t)capacity));
+		if (!grown)
+			return false;
+		memcpy(grown, index, index_size(index->count));
+		vrc7_aligned_free(index);
+		builder->index = index = grown;
+		builder->capacity = capacity;
+	}
+
+	struct vrc7_keyframe *keyframe = (struct vrc7_keyframe *)get_keyframes(index) + index->count;
+	memset(keyframe, 0, sizeof(struct vrc7_keyframe));
+	keyframe->tick = vrc7_s->tick_count;
+	keyframe->offset = offset;
+	vrc7_save_state(vrc7_s, &keyframe->snapshot);
+	index->count++;
+
+	//Keyframes are placed on multiples of the interval, even if a tick was skipped
+	builder->next_tick = (vrc7_s->tick_count / index->interval_ticks + 1) * index->interval_ticks;
+	return true;
+}
+
+VRC7SOUND_API const struct vrc7_index_header *vrc7_index_builder_data(const struct vrc7_index_builder *builder, size_t *size) {
+	*size = index_size(builder->index->count);
+	return builder->index;
+}
+
+VRC7SOUND_API const struct vrc7_index_header *vrc7_index_open(const void *data, size_t size) {
+	const struct vrc7_index_header *index = (const struct vrc7_index_header *)data;
+	if (((uintptr_t)data & 63) != 0 || size < sizeof(struct vrc7_index_header))
+		return NULL;
+	if (index->magic != VRC7_INDEX_MAGIC || index->version != VRC7_INDEX_VERSION || index->keyframe_size != sizeof(struct vrc7_keyframe))
+		return NULL;
+	if (index->interval_ticks == 0 || (size - sizeof(struct vrc7_index_header)) / sizeof(struct vrc7_keyframe) < index->count)
+		return NULL;
+	return index;
+}
+
+VRC7SOUND_API const struct vrc7_keyframe *vrc7_index_find(const struct vrc7_index_header *index, uint64_t tick) {
+	const struct vrc7_keyframe *keyframes = get_keyframes(index);
+
+	//Binary search for the first keyframe after tick
+	uint32_t low = 0, high = index->count;
+	while (low < high) {
+		uint32_t mid = low + (high - low) / 2;
+		if (keyframes[mid].tick <= tick)
+			low = mid + 1;
+		else
+			high = mid;
+	}
+	return low > 0 ? &keyframes[low - 1] : NULL;
+}
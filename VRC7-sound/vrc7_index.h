@@ -0,0 +1,102 @@
+/*
+Keyframe index for random access into register logs.
+
+An index stores a snapshot of the chip (see vrc7_snapshot) every interval_ticks ticks, together with the position in the log where
+playback continues after that snapshot. Seeking restores the nearest keyframe before the target and only replays the rest of the log.
+
+The index is built in one pass while the log is played back: call vrc7_index_builder_add after every tick with the offset of the next
+unread log entry. The finished index is a single block of memory (see vrc7_index_builder_data) that can be written to a file as is:
+
+	struct vrc7_index_header
+	struct vrc7_keyframe[count]
+
+All structures have a fixed size and are aligned to 64 bytes, so a memory mapped file can be used directly with vrc7_index_open.
+Values are stored in the byte order of the machine that built the index.
+*/
+
+#ifndef VRC7_INDEX_H
+#define VRC7_INDEX_H
+
+#include "vrc7_sound.h"
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+#define VRC7_INDEX_MAGIC 0x58493756	//"V7IX"
+#define VRC7_INDEX_VERSION 1
+
+/*
+-- magic:			VRC7_INDEX_MAGIC.
+-- version:			VRC7_INDEX_VERSION.
+-- keyframe_size:	sizeof(struct vrc7_keyframe).
+-- count:			Number of keyframes following the header.
+-- interval_ticks:	Number of ticks between two keyframes.
+*/
+struct VRC7_CACHE_ALIGN vrc7_index_header {
+	uint32_t magic;
+	uint32_t version;
+	uint32_t keyframe_size;
+	uint32_t count;
+	uint64_t interval_ticks;
+	uint8_t reserved[40];
+};
+
+/*
+-- tick:		tick_count of the chip when the snapshot was taken.
+-- offset:		Position in the log where playback continues after this keyframe. The meaning is up to the application (e.g. a byte offset).
+-- snapshot:	State of the chip at tick.
+*/
+struct VRC7_CACHE_ALIGN vrc7_keyframe {
+	uint64_t tick;
+	uint64_t offset;
+	uint8_t reserved[48];
+	struct vrc7_snapshot snapshot;
+};
+
+struct vrc7_index_builder {
+	//private:
+	struct vrc7_index_header *index;
+	size_t capacity;
+	uint64_t next_tick;
+};
+
+/*
+Creates a builder that takes a keyframe every interval_ticks ticks. A chip ticks clock_rate / VRC7_SIGNAL_CHUNK_LENGTH times per second.
+Returns NULL if the allocation failed.
+*/
+VRC7SOUND_API struct vrc7_index_builder *vrc7_index_builder_new(uint64_t interval_ticks);
+
+/*
+Deletes a builder and the index it built.
+*/
+VRC7SOUND_API void vrc7_index_builder_delete(struct vrc7_index_builder *builder);
+
+/*
+Adds a keyframe of vrc7_s if a keyframe is due at its tick_count. offset is the position of the next unread log entry.
+Returns false if the keyframe could not be allocated.
+*/
+VRC7SOUND_API bool vrc7_index_builder_add(struct vrc7_index_builder *builder, const struct vrc7_sound *vrc7_s, uint64_t offset);
+
+/*
+Returns the index built so far and stores its size in bytes in size. The pointer is valid until the next call to vrc7_index_builder_add.
+*/
+VRC7SOUND_API const struct vrc7_index_header *vrc7_index_builder_data(const struct vrc7_index_builder *builder, size_t *size);
+
+/*
+Checks that data of size bytes (e.g. a memory mapped file) contains a valid index and returns it, or NULL if it does not.
+data has to be aligned to 64 bytes, which is always the case for memory mapped files.
+*/
+VRC7SOUND_API const struct vrc7_index_header *vrc7_index_open(const void *data, size_t size);
+
+/*
+Returns the last keyframe at or before tick, or NULL if there is none. Restore it with vrc7_load_state and continue playback
+of the log at its offset.
+*/
+VRC7SOUND_API const struct vrc7_keyframe *vrc7_index_find(const struct vrc7_index_header *index, uint64_t tick);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif
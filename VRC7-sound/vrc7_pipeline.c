@@ -0,0 +1,278 @@
+/*
+Pipelined offline renderer for vrc7_sound. See vrc7_pipeline.h.
+*/
+
+//clock_gettime is only declared for POSIX sources
+#if !defined(_WIN32) && !defined(_POSIX_C_SOURCE)
+#define _POSIX_C_SOURCE 200112L
+#endif
+
+#include "vrc7_pipeline.h"
+#include "vrc7_platform.h"
+
+#include <stdlib.h>
+#include <string.h>
+
+#define QUEUE_MASK (VRC7_PIPELINE_BLOCKS - 1)
+#define RAW_BLOCK_LENGTH (VRC7_PIPELINE_BLOCK_TICKS * VRC7_SIGNAL_CHUNK_LENGTH * 2)
+
+struct block {
+	int16_t *data;
+	uint32_t count;	//Ticks in raw blocks, frames in output blocks
+	bool last;
+};
+
+//Single producer, single consumer queue of block indices. It can hold every block of a link, so pushing never fails.
+struct block_queue {
+	uint32_t slots[VRC7_PIPELINE_BLOCKS];
+	uint8_t padding0[64];
+	volatile uint32_t write_index;
+	uint8_t padding1[64];
+	volatile uint32_t read_index;
+	uint8_t padding2[64];
+};
+
+//Blocks go from the free queue to the producing stage, through the full queue to the consuming stage and back to the free queue
+struct link {
+	struct block blocks[VRC7_PIPELINE_BLOCKS];
+	struct block_queue full;
+	struct block_queue free;
+};
+
+struct pipeline {
+	struct vrc7_sound *vrc7_s;	//Emulation
+	struct vrc7_sound *post;	//Filter and resampler state
+	vrc7_pipeline_update update;
+	vrc7_pipeline_encode encode;
+	void *user;
+
+	struct link raw;
+	struct link out;
+	uint32_t max_frames;
+	volatile uint32_t abort;
+	struct vrc7_pipeline_stats stats;
+};
+
+static void queue_push(struct block_queue *queue, uint32_t index) {
+	uint32_t write_index = queue->write_index;
+	queue->slots[write_index & QUEUE_MASK] = index;
+	vrc7_atomic_store_release(&queue->write_index, write_index + 1);
+}
+
+/*
+Takes the next block from a queue and waits if it is empty. Returns false if the render was aborted while waiting.
+*/
+static bool queue_pop(struct pipeline *p, struct block_queue *queue, uint32_t *index, double *waiting) {
+	uint32_t read_index = queue->read_index;
+	if (vrc7_atomic_load_acquire(&queue->write_index) == read_index) {
+		double start = vrc7_time_now();
+		while (vrc7_atomic_load_acquire(&queue->write_index) == read_index) {
+			if (vrc7_atomic_load_acquire(&p->abort))
+				return false;
+			vrc7_thread_yield();
+		}
+		*waiting += vrc7_time_now() - start;
+	}
+
+	*index = queue->slots[read_index & QUEUE_MASK];
+	vrc7_atomic_store_release(&queue->read_index, read_index + 1);
+	return true;
+}
+
+static bool link_init(struct link *link, size_t length) {
+	for (uint32_t i = 0; i < VRC7_PIPELINE_BLOCKS; i++) {
+		link->blocks[i].data = (int16_t *) malloc(length * sizeof(int16_t));
+		if (!link->blocks[i].data)
+			return false;
+		queue_push(&link->free, i);
+	}
+	return true;
+}
+
+static void link_free(struct link *link) {
+	for (uint32_t i = 0; i < VRC7_PIPELINE_BLOCKS; i++) {
+		free(link->blocks[i].data);
+	}
+}
+
+static VRC7_THREAD_FUNC(emulate_stage) {
+	struct pipeline *p = (struct pipeline *)arg;
+	struct vrc7_pipeline_stage *timing = &p->stats.emulate;
+
+	bool done = false;
+	while (!done) {
+		uint32_t index;
+		if (!queue_pop(p, &p->raw.free, &index, &timing->waiting))
+			break;
+
+		double start = vrc7_time_now();
+		struct block *block = &p->raw.blocks[index];
+		uint32_t count = 0;
+		while (count < VRC7_PIPELINE_BLOCK_TICKS) {
+			if (!p->update(p->user, p->vrc7_s)) {
+				done = true;
+				break;
+			}
+			vrc7_tick(p->vrc7_s);
+
+			//A mono chunk is duplicated here, the filter stage always works in stereo
+			int16_t *chunk = &block->data[count * VRC7_SIGNAL_CHUNK_LENGTH * 2];
+			int right = p->vrc7_s->mono ? STEREO_LEFT : STEREO_RIGHT;
+			memcpy(chunk, p->vrc7_s->signal[STEREO_LEFT], VRC7_SIGNAL_CHUNK_LENGTH * sizeof(int16_t));
+			memcpy(chunk + VRC7_SIGNAL_CHUNK_LENGTH, p->vrc7_s->signal[right], VRC7_SIGNAL_CHUNK_LENGTH * sizeof(int16_t));
+			count++;
+		}
+		block->count = count;
+		block->last = done;
+		p->stats.ticks += count;
+		timing->busy += vrc7_time_now() - start;
+
+		queue_push(&p->raw.full, index);
+	}
+	VRC7_THREAD_RETURN;
+}
+
+static VRC7_THREAD_FUNC(filter_stage) {
+	struct pipeline *p = (struct pipeline *)arg;
+	struct vrc7_pipeline_stage *timing = &p->stats.filter;
+	struct vrc7_sound *post = p->post;
+
+	for (;;) {
+		uint32_t raw_index, out_index;
+		if (!queue_pop(p, &p->raw.full, &raw_index, &timing->waiting))
+			break;
+		if (!queue_pop(p, &p->out.free, &out_index, &timing->waiting))
+			break;
+
+		double start = vrc7_time_now();
+		struct block *raw = &p->raw.blocks[raw_index];
+		struct block *out = &p->out.blocks[out_index];
+		uint32_t frames = 0;
+		for (uint32_t i = 0; i < raw->count; i++) {
+			const int16_t *chunk = &raw->data[i * VRC7_SIGNAL_CHUNK_LENGTH * 2];
+			memcpy(post->signal[STEREO_LEFT], chunk, VRC7_SIGNAL_CHUNK_LENGTH * sizeof(int16_t));
+			memcpy(post->signal[STEREO_RIGHT], chunk + VRC7_SIGNAL_CHUNK_LENGTH, VRC7_SIGNAL_CHUNK_LENGTH * sizeof(int16_t));
+			post->filter(post);
+			frames += vrc7_resample_signal(post, &out->data[frames * 2], p->max_frames - frames);
+		}
+		out->count = frames;
+		out->last = raw->last;
+		bool last = raw->last;
+		timing->busy += vrc7_time_now() - start;
+
+		queue_push(&p->raw.free, raw_index);
+		queue_push(&p->out.full, out_index);
+		if (last)
+			break;
+	}
+	VRC7_THREAD_RETURN;
+}
+
+/*
+Moves the filter and resampler state from one vrc7_sound object to another. A mono source is copied as two identical sides.
+*/
+static void copy_output_state(struct vrc7_sound *dest, const struct vrc7_sound *src) {
+	dest->filter = src->filter;
+	dest->time = src->time;
+	for (int side = 0; side < 2; side++) {
+		int source = src->mono ? STEREO_LEFT : side;
+		dest->prev_input[side] = src->prev_input[source];
+		dest->prev_output[side] = src->prev_output[source];
+		memcpy(dest->signal[side], src->signal[source], VRC7_SIGNAL_CHUNK_LENGTH * sizeof(int16_t));
+	}
+}
+
+static void pipeline_delete(struct pipeline *p) {
+	if (p->post)
+		vrc7_delete(p->post);
+	link_free(&p->raw);
+	link_free(&p->out);
+	free(p);
+}
+
+VRC7SOUND_API bool vrc7_render_pipelined(struct vrc7_sound *vrc7_s, vrc7_pipeline_update update, vrc7_pipeline_encode encode,
+		void *user, struct vrc7_pipeline_stats *stats) {
+	//The filter stage has no decimator, fast-forward would silently play at normal speed
+	if (vrc7_s->fast_forward > 1)
+		return false;
+
+	struct pipeline *p = (struct pipeline *) calloc(1, sizeof(struct pipeline));
+	if (!p)
+		return false;
+	p->vrc7_s = vrc7_s;
+	p->update = update;
+	p->encode = encode;
+	p->user = user;
+
+	//The output blocks have to hold every frame that falls into the ticks of a raw block
+	double step = vrc7_s->clock_rate / vrc7_s->sample_rate;
+	p->max_frames = (uint32_t)(VRC7_PIPELINE_BLOCK_TICKS * VRC7_SIGNAL_CHUNK_LENGTH / step) + 2;
+
+	//The filter stage uses its own object with the same rates, so the filter coefficients match
+	p->post = vrc7_new();
+	if (!p->post || !link_init(&p->raw, RAW_BLOCK_LENGTH) || !link_init(&p->out, (size_t)p->max_frames * 2)) {
+		pipeline_delete(p);
+		return false;
+	}
+	vrc7_set_clock_rate(p->post, vrc7_s->clock_rate);
+	vrc7_set_sample_rate(p->post, vrc7_s->sample_rate);
+	copy_output_state(p->post, vrc7_s);
+	vrc7_s->filter = vrc7_filter_raw;
+
+	double start = vrc7_time_now();
+
+	//Samples that are still due from the current chunk
+	bool ok = true;
+	struct block *first = &p->out.blocks[0];
+	first->count = vrc7_resample_signal(p->post, first->data, p->max_frames);
+	if (first->count) {
+		ok = encode(user, first->data, first->count);
+		p->stats.frames += first->count;
+	}
+
+	vrc7_thread emulate_thread, filter_thread;
+	if (ok && vrc7_thread_start(&emulate_thread, emulate_stage, p)) {
+		if (vrc7_thread_start(&filter_thread, filter_stage, p)) {
+			//Encode stage
+			for (;;) {
+				uint32_t index;
+				if (!queue_pop(p, &p->out.full, &index, &p->stats.encode.waiting))
+					break;
+
+				double encode_start = vrc7_time_now();
+				struct block *block = &p->out.blocks[index];
+				if (block->count && !encode(user, block->data, block->count)) {
+					ok = false;
+					vrc7_atomic_store_release(&p->abort, 1);
+				}
+				p->stats.frames += block->count;
+				bool last = block->last;
+				p->stats.encode.busy += vrc7_time_now() - encode_start;
+
+				queue_push(&p->out.free, index);
+				if (last || !ok)
+					break;
+			}
+			vrc7_thread_join(filter_thread);
+		}
+		else {
+			ok = false;
+			vrc7_atomic_store_release(&p->abort, 1);
+		}
+		vrc7_thread_join(emulate_thread);
+	}
+	else {
+		ok = false;
+	}
+	p->stats.total = vrc7_time_now() - start;
+
+	//Hand the output state back, so vrc7_fetch_sample continues where the render stopped. vrc7_resample_signal has already moved
+	//the resampler on to the next chunk, but vrc7_fetch_sample ticks before it moves on, so the last move is undone.
+	copy_output_state(vrc7_s, p->post);
+	vrc7_s->time.current += VRC7_SIGNAL_CHUNK_LENGTH;
+	if (stats)
+		*stats = p->stats;
+
+	pipeline_delete(p);
+	return ok;
+}
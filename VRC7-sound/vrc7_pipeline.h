@@ -0,0 +1,80 @@
+/*
+Pipelined offline renderer for vrc7_sound.
+
+vrc7_render_pipelined splits rendering into three stages that run on separate threads:
+-- emulate:		Calls the update callback and vrc7_tick once per tick with the filter disabled (emulation thread).
+-- filter:		Applies the output filter of the vrc7_sound object and resamples to the sample rate (filter thread).
+-- encode:		Passes the samples to the encode callback (calling thread).
+The stages exchange fixed size blocks through bounded lock-free queues. All blocks are allocated up front and reused, so a render
+does not allocate after it started. The samples are the same that vrc7_fetch_sample would produce from the same ticks.
+
+This is meant for long offline renders (e.g. to a file). Use vrc7_fetch_sample or vrc7_stream for real-time playback.
+*/
+
+#ifndef VRC7_PIPELINE_H
+#define VRC7_PIPELINE_H
+
+#include "vrc7_sound.h"
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+//Number of ticks per block and number of blocks between two stages
+#define VRC7_PIPELINE_BLOCK_TICKS 256
+#define VRC7_PIPELINE_BLOCKS 8
+
+/*
+Called by the emulation thread before every tick. Write the registers that change at this tick to vrc7_s.
+Return false to end the render; the tick is then not rendered.
+*/
+typedef bool(*vrc7_pipeline_update)(void *user, struct vrc7_sound *vrc7_s);
+
+/*
+Called by the calling thread with count interleaved stereo frames. Return false to abort the render.
+*/
+typedef bool(*vrc7_pipeline_encode)(void *user, const int16_t *frames, uint32_t count);
+
+/*
+Time a stage spent in seconds.
+-- busy:		Time spent working, including the callbacks.
+-- waiting:		Time spent waiting for the previous stage (input) or the next stage (free blocks).
+The stage with the least waiting time bounds the throughput of the pipeline.
+*/
+struct vrc7_pipeline_stage {
+	double busy;
+	double waiting;
+};
+
+/*
+Statistics of a render.
+-- ticks:		Number of ticks rendered.
+-- frames:		Number of frames passed to the encode callback.
+-- total:		Wall clock time of the render in seconds.
+*/
+struct vrc7_pipeline_stats {
+	uint64_t ticks;
+	uint64_t frames;
+	double total;
+	struct vrc7_pipeline_stage emulate;
+	struct vrc7_pipeline_stage filter;
+	struct vrc7_pipeline_stage encode;
+};
+
+/*
+Renders vrc7_s until update returns false or encode aborts. Set the clock rate, sample rate and filter of vrc7_s before calling this function.
+Afterwards vrc7_s is in the same state as after rendering with vrc7_fetch_sample, so playback can continue from there. This does not
+hold if the encode callback aborted the render: the emulation has then run ahead of the output and the state of vrc7_s is undefined,
+so reset it or load a state before using it again.
+vrc7_s must not be used by other threads during the render. stats may be NULL.
+Fast-forward (see vrc7_set_fast_forward) is not supported: the render is rejected if the factor of vrc7_s is not 1.
+Returns false if the render was rejected, aborted by the encode callback or the threads or buffers could not be created.
+*/
+VRC7SOUND_API bool vrc7_render_pipelined(struct vrc7_sound *vrc7_s, vrc7_pipeline_update update, vrc7_pipeline_encode encode,
+	void *user, struct vrc7_pipeline_stats *stats);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif
@@ -0,0 +1,138 @@
+/*
+Platform specific helpers used internally by vrc7_sound. This header is not part of the public API.
+
+-- vrc7_atomic_load_acquire:	Loads a 32-bit value. Memory operations after the load can not be moved before it.
+-- vrc7_atomic_store_release:	Stores a 32-bit value. Memory operations before the store can not be moved after it.
+-- vrc7_atomic_compare_swap:	Stores a 32-bit value if the old value is as expected, as a full barrier. Returns true if it was stored.
+-- vrc7_thread_start:			Starts a thread running a function declared with VRC7_THREAD_FUNC. Returns false on failure.
+-- vrc7_thread_join:			Waits for a thread to finish.
+-- vrc7_thread_yield:			Gives the rest of the time slice to other threads.
+-- vrc7_time_now:				Monotonic time in seconds.
+-- vrc7_aligned_alloc:			Allocates memory aligned to a cache line (64 bytes). Returns NULL on failure.
+-- vrc7_aligned_free:			Frees memory allocated with vrc7_aligned_alloc.
+*/
+
+#ifndef VRC7_PLATFORM_H
+#define VRC7_PLATFORM_H
+
+#include <stdint.h>
+#include <stdlib.h>
+
+#if defined(_MSC_VER)
+
+#include <intrin.h>
+#include <malloc.h>
+
+static __inline void *vrc7_aligned_alloc(size_t size) {
+	return _aligned_malloc(size, 64);
+}
+
+static __inline void vrc7_aligned_free(void *data) {
+	_aligned_free(data);
+}
+
+//The interlocked functions are full barriers on every architecture supported by MSVC
+static __inline uint32_t vrc7_atomic_load_acquire(volatile uint32_t *ptr) {
+	return (uint32_t)_InterlockedOr((volatile long *)ptr, 0);
+}
+
+static __inline void vrc7_atomic_store_release(volatile uint32_t *ptr, uint32_t value) {
+	_InterlockedExchange((volatile long *)ptr, (long)value);
+}
+
+static __inline int vrc7_atomic_compare_swap(volatile uint32_t *ptr, uint32_t expected, uint32_t value) {
+	return _InterlockedCompareExchange((volatile long *)ptr, (long)value, (long)expected) == (long)expected;
+}
+
+#elif defined(__GNUC__) || defined(__clang__)
+
+static inline void *vrc7_aligned_alloc(size_t size) {
+	void *data;
+	if (posix_memalign(&data, 64, size) != 0)
+		return NULL;
+	return data;
+}
+
+static inline void vrc7_aligned_free(void *data) {
+	free(data);
+}
+
+static inline uint32_t vrc7_atomic_load_acquire(volatile uint32_t *ptr) {
+	return __atomic_load_n(ptr, __ATOMIC_ACQUIRE);
+}
+
+static inline void vrc7_atomic_store_release(volatile uint32_t *ptr, uint32_t value) {
+	__atomic_store_n(ptr, value, __ATOMIC_RELEASE);
+}
+
+static inline int vrc7_atomic_compare_swap(volatile uint32_t *ptr, uint32_t expected, uint32_t value) {
+	return __atomic_compare_exchange_n(ptr, &expected, value, 0, __ATOMIC_SEQ_CST, __ATOMIC_SEQ_CST);
+}
+
+#else
+#error "vrc7_platform.h: no atomic operations available for this compiler"
+#endif
+
+#if defined(_WIN32)
+
+#ifndef WIN32_LEAN_AND_MEAN
+#define WIN32_LEAN_AND_MEAN
+#endif
+#include <windows.h>
+
+typedef HANDLE vrc7_thread;
+#define VRC7_THREAD_FUNC(name) DWORD WINAPI name(LPVOID arg)
+#define VRC7_THREAD_RETURN return 0
+
+static __inline int vrc7_thread_start(vrc7_thread *thread, LPTHREAD_START_ROUTINE func, void *arg) {
+	*thread = CreateThread(NULL, 0, func, arg, 0, NULL);
+	return *thread != NULL;
+}
+
+static __inline void vrc7_thread_join(vrc7_thread thread) {
+	WaitForSingleObject(thread, INFINITE);
+	CloseHandle(thread);
+}
+
+static __inline void vrc7_thread_yield(void) {
+	SwitchToThread();
+}
+
+static __inline double vrc7_time_now(void) {
+	LARGE_INTEGER counter, frequency;
+	QueryPerformanceCounter(&counter);
+	QueryPerformanceFrequency(&frequency);
+	return (double)counter.QuadPart / (double)frequency.QuadPart;
+}
+
+#else
+
+#include <pthread.h>
+#include <sched.h>
+#include <time.h>
+
+typedef pthread_t vrc7_thread;
+#define VRC7_THREAD_FUNC(name) void *name(void *arg)
+#define VRC7_THREAD_RETURN return NULL
+
+static inline int vrc7_thread_start(vrc7_thread *thread, void *(*func)(void *), void *arg) {
+	return pthread_create(thread, NULL, func, arg) == 0;
+}
+
+static inline void vrc7_thread_join(vrc7_thread thread) {
+	pthread_join(thread, NULL);
+}
+
+static inline void vrc7_thread_yield(void) {
+	sched_yield();
+}
+
+static inline double vrc7_time_now(void) {
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (double)ts.tv_sec + (double)ts.tv_nsec * 1e-9;
+}
+
+#endif
+
+#endif
@@ -0,0 +1,164 @@
+/*
+Rewind buffer for vrc7_sound. See vrc7_rewind.h.
+
+Each older frame is stored in the ring as
+	uint16_t length
+	uint8_t  data[length]		(XOR difference to the next frame, see encode_delta)
+	uint16_t length
+The length is stored at both ends, so entries can be dropped from the tail and undone from the head.
+*/
+
+//posix_memalign is only declared for POSIX sources
+#if !defined(_WIN32) && !defined(_POSIX_C_SOURCE)
+#define _POSIX_C_SOURCE 200112L
+#endif
+
+#include "vrc7_rewind.h"
+#include "vrc7_platform.h"
+
+#include <stdlib.h>
+#include <string.h>
+
+#define SNAPSHOT_SIZE sizeof(struct vrc7_snapshot)
+#define MAX_RUN 255
+
+/*
+Stores a ^ b as a sequence of (number of zero bytes, number of literal bytes, literal bytes) with both counts limited to MAX_RUN.
+Returns the encoded length, which is at most sizeof(rewind->delta).
+*/
+static uint32_t encode_delta(const uint8_t *a, const uint8_t *b, uint8_t *out) {
+	uint32_t pos = 0;
+	uint32_t length = 0;
+	while (pos < SNAPSHOT_SIZE) {
+		uint32_t zeros = 0;
+		while (pos < SNAPSHOT_SIZE && zeros < MAX_RUN && a[pos] == b[pos]) {
+			zeros++;
+			pos++;
+		}
+
+		uint32_t literals = 0;
+		while (pos + literals < SNAPSHOT_SIZE && literals < MAX_RUN && a[pos + literals] != b[pos + literals])
+			literals++;
+
+		out[length++] = (uint8_t)zeros;
+		out[length++] = (uint8_t)literals;
+		for (uint32_t i = 0; i < literals; i++, pos++) {
+			out[length++] = a[pos] ^ b[pos];
+		}
+	}
+	return length;
+}
+
+/*
+XORs an encoded difference into a snapshot.
+*/
+static void apply_delta(uint8_t *target, const uint8_t *delta, uint32_t length) {
+	uint32_t pos = 0;
+	uint32_t i = 0;
+	while (i < length) {
+		pos += delta[i++];
+		uint32_t literals = delta[i++];
+		for (uint32_t j = 0; j < literals; j++) {
+			target[pos++] ^= delta[i++];
+		}
+	}
+}
+
+static void ring_write(struct vrc7_rewind *rewind, uint32_t pos, const uint8_t *data, uint32_t length) {
+	uint32_t start = pos & (rewind->capacity - 1);
+	uint32_t first = length < rewind->capacity - start ? length : rewind->capacity - start;
+	memcpy(&rewind->ring[start], data, first);
+	memcpy(rewind->ring, data + first, length - first);
+}
+
+static void ring_read(const struct vrc7_rewind *rewind, uint32_t pos, uint8_t *data, uint32_t length) {
+	uint32_t start = pos & (rewind->capacity - 1);
+	uint32_t first = length < rewind->capacity - start ? length : rewind->capacity - start;
+	memcpy(data, &rewind->ring[start], first);
+	memcpy(data + first, rewind->ring, length - first);
+}
+
+static uint32_t ring_read_length(const struct vrc7_rewind *rewind, uint32_t pos) {
+	uint8_t bytes[2];
+	ring_read(rewind, pos, bytes, 2);
+	return bytes[0] | bytes[1] << 8;
+}
+
+VRC7SOUND_API struct vrc7_rewind *vrc7_rewind_new(uint32_t capacity) {
+	uint32_t size = VRC7_REWIND_MIN_CAPACITY;
+	while (size < capacity && size < 0x80000000u)
+		size <<= 1;
+
+	struct vrc7_rewind *rewind = (struct vrc7_rewind *) vrc7_aligned_alloc(sizeof(struct vrc7_rewind));
+	if (!rewind)
+		return NULL;
+	memset(rewind, 0, sizeof(struct vrc7_rewind));
+
+	rewind->ring = (uint8_t *) malloc(size);
+	if (!rewind->ring) {
+		vrc7_aligned_free(rewind);
+		return NULL;
+	}
+	rewind->capacity = size;
+	return rewind;
+}
+
+VRC7SOUND_API void vrc7_rewind_delete(struct vrc7_rewind *rewind) {
+	free(rewind->ring);
+	vrc7_aligned_free(rewind);
+}
+
+VRC7SOUND_API void vrc7_rewind_push(struct vrc7_rewind *rewind, const struct vrc7_sound *vrc7_s) {
+	vrc7_save_state(vrc7_s, &rewind->current);
+	if (rewind->frames == 0) {
+		rewind->newest = rewind->current;
+		rewind->frames = 1;
+		return;
+	}
+
+	//The difference turns the new frame back into the previous one
+	uint32_t length = encode_delta((const uint8_t *)&rewind->newest, (const uint8_t *)&rewind->current, rewind->delta);
+	uint32_t entry_size = length + 4;
+
+	//Drop the oldest frames until the entry fits
+	while (rewind->used + entry_size > rewind->capacity) {
+		uint32_t oldest_size = ring_read_length(rewind, rewind->tail) + 4;
+		rewind->tail += oldest_size;
+		rewind->used -= oldest_size;
+		rewind->frames--;
+	}
+
+	uint8_t header[2] = { (uint8_t)length, (uint8_t)(length >> 8) };
+	ring_write(rewind, rewind->head, header, 2);
+	ring_write(rewind, rewind->head + 2, rewind->delta, length);
+	ring_write(rewind, rewind->head + 2 + length, header, 2);
+	rewind->head += entry_size;
+	rewind->used += entry_size;
+	rewind->frames++;
+
+	rewind->newest = rewind->current;
+}
+
+VRC7SOUND_API bool vrc7_rewind_restore(struct vrc7_rewind *rewind, struct vrc7_sound *vrc7_s, uint32_t frames_back) {
+	if (frames_back >= rewind->frames)
+		return false;
+
+	for (uint32_t i = 0; i < frames_back; i++) {
+		uint32_t length = ring_read_length(rewind, rewind->head - 2);
+		ring_read(rewind, rewind->head - 2 - length, rewind->delta, length);
+		apply_delta((uint8_t *)&rewind->newest, rewind->delta, length);
+
+		rewind->head -= length + 4;
+		rewind->used -= length + 4;
+		rewind->frames--;
+	}
+
+	vrc7_load_state(vrc7_s, &rewind->newest);
+	return true;
+}
+
+VRC7SOUND_API void vrc7_rewind_clear(struct vrc7_rewind *rewind) {
+	rewind->frames = 0;
+	rewind->used = 0;
+	rewind->head = rewind->tail = 0;
+}
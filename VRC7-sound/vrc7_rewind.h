@@ -0,0 +1,75 @@
+/*
+Rewind buffer for vrc7_sound.
+
+Records a snapshot of the chip (see vrc7_snapshot) every frame. Only the newest snapshot is kept in full; every older frame is stored as
+the XOR difference to the frame after it, with runs of unchanged bytes removed. Most of the chip state does not change between two frames,
+so a frame usually takes a small fraction of a full snapshot.
+
+The differences are stored in a ring of fixed size that is allocated when the buffer is created. When it is full, the oldest frames are
+dropped. Restoring a frame undoes one difference per frame going back, so going back a few frames is cheap.
+*/
+
+#ifndef VRC7_REWIND_H
+#define VRC7_REWIND_H
+
+#include "vrc7_sound.h"
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+//Minimum size of the ring, enough for a few worst case frames
+#define VRC7_REWIND_MIN_CAPACITY 4096
+
+/*
+-- frames:		Number of recorded frames, including the newest one. vrc7_rewind_restore can go back frames - 1 frames.
+-- capacity:	Size of the ring in bytes.
+-- used:		Bytes of the ring that are in use.
+*/
+struct VRC7_CACHE_ALIGN vrc7_rewind {
+	//Read only:
+	uint32_t frames;
+	uint32_t capacity;
+	uint32_t used;
+
+	//private:
+	uint8_t *ring;
+	uint32_t head;
+	uint32_t tail;
+	struct vrc7_snapshot newest;
+	struct vrc7_snapshot current;
+	uint8_t delta[sizeof(struct vrc7_snapshot) * 3 / 2 + 8];
+};
+
+/*
+Creates a rewind buffer whose ring takes capacity bytes. The capacity is rounded up to a power of two and to at least VRC7_REWIND_MIN_CAPACITY.
+Returns NULL if the allocation failed.
+*/
+VRC7SOUND_API struct vrc7_rewind *vrc7_rewind_new(uint32_t capacity);
+
+/*
+Deletes a rewind buffer.
+*/
+VRC7SOUND_API void vrc7_rewind_delete(struct vrc7_rewind *rewind);
+
+/*
+Records the current state of vrc7_s as the newest frame. Call this once per emulated frame.
+*/
+VRC7SOUND_API void vrc7_rewind_push(struct vrc7_rewind *rewind, const struct vrc7_sound *vrc7_s);
+
+/*
+Restores the state of vrc7_s from frames_back frames before the newest one (0 restores the newest frame). The frames after it are
+discarded, so recording continues from the restored frame. Returns false if fewer frames were recorded; vrc7_s is then not changed.
+*/
+VRC7SOUND_API bool vrc7_rewind_restore(struct vrc7_rewind *rewind, struct vrc7_sound *vrc7_s, uint32_t frames_back);
+
+/*
+Discards all recorded frames.
+*/
+VRC7SOUND_API void vrc7_rewind_clear(struct vrc7_rewind *rewind);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif
@@ -0,0 +1,351 @@
+/*
+Shared-memory audio ring for vrc7_sound. See vrc7_shm.h.
+*/
+
+//memfd_create and eventfd are Linux extensions, shm_open and clock_gettime are only declared for POSIX sources
+#if defined(__linux__) && !defined(_GNU_SOURCE)
+#define _GNU_SOURCE
+#elif !defined(_WIN32) && !defined(_POSIX_C_SOURCE)
+#define _POSIX_C_SOURCE 200112L
+#endif
+
+#include "vrc7_shm.h"
+#include "vrc7_platform.h"
+
+#include <stdlib.h>
+#include <string.h>
+
+#if !defined(_WIN32)
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#if defined(__linux__)
+#include <poll.h>
+#include <sys/eventfd.h>
+#include <sys/syscall.h>
+#else
+#include <stdio.h>
+#endif
+#endif
+
+typedef char shm_header_size_check[sizeof(struct vrc7_shm_header) == 192 ? 1 : -1];
+
+#define MAX_CAPACITY 0x10000000u
+
+/*
+Size of the shared memory of a ring.
+*/
+static size_t shm_size(uint32_t capacity, uint32_t channels) {
+	return sizeof(struct vrc7_shm_header) + (size_t)capacity * channels * sizeof(int16_t);
+}
+
+/*
+Platform dependent parts: creating, mapping and closing the memory and the event.
+*/
+#if defined(_WIN32)
+
+static bool create_handles(struct vrc7_shm_handles *handles, size_t size) {
+	SECURITY_ATTRIBUTES attributes = { sizeof(SECURITY_ATTRIBUTES), NULL, TRUE };
+	HANDLE mapping = CreateFileMappingW(INVALID_HANDLE_VALUE, &attributes, PAGE_READWRITE, (DWORD)((uint64_t)size >> 32), (DWORD)size, NULL);
+	if (!mapping)
+		return false;
+	HANDLE event = CreateEventW(&attributes, FALSE, FALSE, NULL);
+	if (!event) {
+		CloseHandle(mapping);
+		return false;
+	}
+	handles->memory = (intptr_t)mapping;
+	handles->event = (intptr_t)event;
+	return true;
+}
+
+static size_t get_size(const struct vrc7_shm_handles *handles, void *view) {
+	(void)handles;
+	MEMORY_BASIC_INFORMATION info;
+	if (!VirtualQuery(view, &info, sizeof(info)))
+		return 0;
+	return info.RegionSize;
+}
+
+static void *map_memory(const struct vrc7_shm_handles *handles, size_t size) {
+	return MapViewOfFile((HANDLE)handles->memory, FILE_MAP_ALL_ACCESS, 0, 0, size);
+}
+
+static void unmap_memory(void *view, size_t size) {
+	(void)size;
+	UnmapViewOfFile(view);
+}
+
+static void close_handles(const struct vrc7_shm_handles *handles) {
+	if (handles->event != -1)
+		CloseHandle((HANDLE)handles->event);
+	CloseHandle((HANDLE)handles->memory);
+}
+
+static void signal_event(const struct vrc7_shm_handles *handles) {
+	SetEvent((HANDLE)handles->event);
+}
+
+static void wait_event(const struct vrc7_shm_handles *handles, uint32_t timeout_ms) {
+	WaitForSingleObject((HANDLE)handles->event, timeout_ms);
+}
+
+#else
+
+static bool create_handles(struct vrc7_shm_handles *handles, size_t size) {
+#if defined(__linux__)
+	int memory = (int)syscall(SYS_memfd_create, "vrc7_shm", 0);
+	if (memory < 0)
+		return false;
+#else
+	//Create a uniquely named object and unlink it right away, only the descriptor refers to it
+	static uint32_t counter;
+	char name[64];
+	snprintf(name, sizeof(name), "/vrc7_shm_%ld_%u", (long)getpid(), (unsigned)counter++);
+	int memory = shm_open(name, O_RDWR | O_CREAT | O_EXCL, 0600);
+	if (memory < 0)
+		return false;
+	shm_unlink(name);
+#endif
+	if (ftruncate(memory, (off_t)size) != 0) {
+		close(memory);
+		return false;
+	}
+
+#if defined(__linux__)
+	int event = eventfd(0, 0);
+	if (event < 0) {
+		close(memory);
+		return false;
+	}
+#else
+	int event = -1;
+#endif
+	handles->memory = memory;
+	handles->event = event;
+	return true;
+}
+
+static size_t get_size(const struct vrc7_shm_handles *handles, void *view) {
+	(void)view;
+	struct stat info;
+	if (fstat((int)handles->memory, &info) != 0 || info.st_size < 0)
+		return 0;
+	return (size_t)info.st_size;
+}
+
+static void *map_memory(const struct vrc7_shm_handles *handles, size_t size) {
+	void *view = mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_SHARED, (int)handles->memory, 0);
+	return view != MAP_FAILED ? view : NULL;
+}
+
+static void unmap_memory(void *view, size_t size) {
+	munmap(view, size);
+}
+
+static void close_handles(const struct vrc7_shm_handles *handles) {
+	if (handles->event != -1)
+		close((int)handles->event);
+	close((int)handles->memory);
+}
+
+static void signal_event(const struct vrc7_shm_handles *handles) {
+#if defined(__linux__)
+	uint64_t one = 1;
+	ssize_t written = write((int)handles->event, &one, sizeof(one));
+	(void)written;
+#else
+	(void)handles;
+#endif
+}
+
+static void wait_event(const struct vrc7_shm_handles *handles, uint32_t timeout_ms) {
+#if defined(__linux__)
+	struct pollfd fd = { (int)handles->event, POLLIN, 0 };
+	if (poll(&fd, 1, (int)timeout_ms) > 0) {
+		//Reset the counter, the frames are checked by the caller
+		uint64_t count;
+		ssize_t bytes = read((int)handles->event, &count, sizeof(count));
+		(void)bytes;
+	}
+#else
+	(void)handles;
+	(void)timeout_ms;
+	struct timespec ts = { 0, 1000000L };
+	nanosleep(&ts, NULL);
+#endif
+}
+
+#endif
+
+static struct vrc7_shm *map_ring(const struct vrc7_shm_handles *handles, size_t size) {
+	struct vrc7_shm *shm = (struct vrc7_shm *) calloc(1, sizeof(struct vrc7_shm));
+	if (!shm)
+		return NULL;
+
+	shm->header = (struct vrc7_shm_header *) map_memory(handles, size);
+	if (!shm->header) {
+		free(shm);
+		return NULL;
+	}
+	shm->frames = (int16_t *)(shm->header + 1);
+	shm->handles = *handles;
+	shm->size = size;
+	return shm;
+}
+
+VRC7SOUND_API struct vrc7_shm *vrc7_shm_create(uint32_t capacity, uint32_t channels, double sample_rate) {
+	if (channels < 1 || channels > 2)
+		return NULL;
+
+	uint32_t size = 64;
+	while (size < capacity && size < MAX_CAPACITY)
+		size <<= 1;
+
+	struct vrc7_shm_handles handles;
+	if (!create_handles(&handles, shm_size(size, channels)))
+		return NULL;
+
+	struct vrc7_shm *shm = map_ring(&handles, shm_size(size, channels));
+	if (!shm) {
+		close_handles(&handles);
+		return NULL;
+	}
+
+	//The memory starts out zeroed, so the indices are 0
+	struct vrc7_shm_header *header = shm->header;
+	header->capacity = size;
+	header->channels = channels;
+	header->sample_rate = sample_rate;
+	header->version = VRC7_SHM_VERSION;
+	header->magic = VRC7_SHM_MAGIC;
+	shm->capacity = size;
+	shm->channels = channels;
+	return shm;
+}
+
+VRC7SOUND_API struct vrc7_shm *vrc7_shm_open(const struct vrc7_shm_handles *handles) {
+#if defined(_WIN32)
+	//The size of a mapping can only be queried through a view of it
+	struct vrc7_shm *shm = map_ring(handles, 0);
+	if (!shm)
+		return NULL;
+	size_t size = get_size(handles, shm->header);
+#else
+	size_t size = get_size(handles, NULL);
+	if (size < sizeof(struct vrc7_shm_header))
+		return NULL;
+	struct vrc7_shm *shm = map_ring(handles, size);
+	if (!shm)
+		return NULL;
+#endif
+
+	//Copy the geometry, so a broken producer cannot make the consumer read outside the memory
+	const struct vrc7_shm_header *header = shm->header;
+	uint32_t capacity = header->capacity;
+	uint32_t channels = header->channels;
+	if (size < sizeof(struct vrc7_shm_header) || header->magic != VRC7_SHM_MAGIC || header->version != VRC7_SHM_VERSION ||
+		channels < 1 || channels > 2 || capacity == 0 || capacity > MAX_CAPACITY || (capacity & (capacity - 1)) != 0 ||
+		size < shm_size(capacity, channels)) {
+		unmap_memory(shm->header, shm->size);
+		free(shm);
+		return NULL;
+	}
+	shm->capacity = capacity;
+	shm->channels = channels;
+	return shm;
+}
+
+VRC7SOUND_API void vrc7_shm_close(struct vrc7_shm *shm) {
+	unmap_memory(shm->header, shm->size);
+	close_handles(&shm->handles);
+	free(shm);
+}
+
+VRC7SOUND_API uint32_t vrc7_shm_free_frames(struct vrc7_shm *shm) {
+	uint32_t read_index = vrc7_atomic_load_acquire(&shm->header->read_index);
+	uint32_t used = shm->header->write_index - read_index;
+	//Never trust the other process: an index outside the ring counts as a full ring
+	return used <= shm->capacity ? shm->capacity - used : 0;
+}
+
+/*
+Makes count frames after write_index visible to the consumer and wakes it up.
+*/
+static void publish(struct vrc7_shm *shm, uint32_t write_index, uint32_t count) {
+	if (count == 0)
+		return;
+	vrc7_atomic_store_release(&shm->header->write_index, write_index + count);
+	signal_event(&shm->handles);
+}
+
+VRC7SOUND_API uint32_t vrc7_shm_render(struct vrc7_shm *shm, struct vrc7_sound *vrc7_s, uint32_t frames) {
+	uint32_t available = vrc7_shm_free_frames(shm);
+	uint32_t count = frames < available ? frames : available;
+	uint32_t write_index = shm->header->write_index;
+	uint32_t mask = shm->capacity - 1;
+
+	for (uint32_t i = 0; i < count; i++) {
+		uint32_t pos = (write_index + i) & mask;
+		if (shm->channels == 2) {
+			vrc7_fetch_sample(vrc7_s, &shm->frames[pos * 2]);
+		} else {
+			int16_t sample[2];
+			vrc7_fetch_sample(vrc7_s, sample);
+			shm->frames[pos] = sample[0];
+		}
+	}
+
+	publish(shm, write_index, count);
+	return count;
+}
+
+VRC7SOUND_API uint32_t vrc7_shm_write(struct vrc7_shm *shm, const int16_t *frames, uint32_t count) {
+	uint32_t available = vrc7_shm_free_frames(shm);
+	if (count > available)
+		count = available;
+	if (count > shm->capacity)
+		count = shm->capacity;
+	uint32_t write_index = shm->header->write_index;
+	uint32_t start = write_index & (shm->capacity - 1);
+	uint32_t first = count < shm->capacity - start ? count : shm->capacity - start;
+
+	memcpy(&shm->frames[start * shm->channels], frames, (size_t)first * shm->channels * sizeof(int16_t));
+	memcpy(shm->frames, frames + first * shm->channels, (size_t)(count - first) * shm->channels * sizeof(int16_t));
+
+	publish(shm, write_index, count);
+	return count;
+}
+
+VRC7SOUND_API uint32_t vrc7_shm_available(struct vrc7_shm *shm) {
+	uint32_t available = vrc7_atomic_load_acquire(&shm->header->write_index) - shm->header->read_index;
+	//Never trust the other process with more than the ring holds
+	return available <= shm->capacity ? available : shm->capacity;
+}
+
+VRC7SOUND_API const int16_t *vrc7_shm_peek(struct vrc7_shm *shm, uint32_t *frames) {
+	uint32_t available = vrc7_shm_available(shm);
+	uint32_t start = shm->header->read_index & (shm->capacity - 1);
+	*frames = available < shm->capacity - start ? available : shm->capacity - start;
+	return &shm->frames[start * shm->channels];
+}
+
+VRC7SOUND_API void vrc7_shm_consume(struct vrc7_shm *shm, uint32_t frames) {
+	uint32_t available = vrc7_shm_available(shm);
+	if (frames > available)
+		frames = available;
+	vrc7_atomic_store_release(&shm->header->read_index, shm->header->read_index + frames);
+}
+
+VRC7SOUND_API bool vrc7_shm_wait(struct vrc7_shm *shm, uint32_t min_frames, uint32_t timeout_ms) {
+	double deadline = vrc7_time_now() + timeout_ms * 0.001;
+	while (vrc7_shm_available(shm) < min_frames) {
+		double remaining = (deadline - vrc7_time_now()) * 1000.0;
+		if (remaining <= 0.0)
+			return false;
+		//Round up, so a short timeout still waits instead of spinning
+		wait_event(&shm->handles, (uint32_t)remaining + 1);
+	}
+	return true;
+}
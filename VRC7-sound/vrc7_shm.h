@@ -0,0 +1,150 @@
+/*
+Shared-memory audio ring for vrc7_sound.
+
+Renders into a ring of frames in shared memory, so another process (e.g. the one that owns the audio device) can play them without any
+copies or pipes. The ring has a single producer and a single consumer. Both indices are stored in the shared memory and updated with
+atomic operations, so neither side ever blocks the other.
+
+The producer creates the ring with vrc7_shm_create and passes the handles (see vrc7_shm_handles) to the consumer process, which maps the
+same memory with vrc7_shm_open. Every time the producer publishes frames, it signals an event the consumer can wait on with vrc7_shm_wait.
+
+-- Linux:	The memory is a memfd, the event an eventfd. Pass both file descriptors to the consumer, e.g. over a UNIX domain socket
+			(SCM_RIGHTS) or by inheriting them.
+-- Windows:	The memory is an unnamed file mapping, the event an auto-reset event. Both handles are inheritable; alternatively copy them into
+			the consumer process with DuplicateHandle.
+-- Other:	The memory is a POSIX shared memory object that is unlinked right away, so only the descriptor refers to it. There is no event,
+			vrc7_shm_wait sleeps in steps of 1 ms instead.
+
+The layout of the shared memory is
+	struct vrc7_shm_header
+	int16_t frames[capacity * channels]
+with frame n stored at index (n & (capacity - 1)). The layout does not depend on the pointer size, so a 32 bit consumer can read the ring
+of a 64 bit producer. Values are stored in the byte order of the producer.
+*/
+
+#ifndef VRC7_SHM_H
+#define VRC7_SHM_H
+
+#include "vrc7_sound.h"
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+#define VRC7_SHM_MAGIC 0x4d533756	//"V7SM"
+#define VRC7_SHM_VERSION 1
+
+/*
+Start of the shared memory.
+-- magic:			VRC7_SHM_MAGIC.
+-- version:			VRC7_SHM_VERSION.
+-- capacity:		Number of frames in the ring, a power of two.
+-- channels:		Samples per frame: 2 for interleaved stereo, 1 for mono.
+-- sample_rate:		Sample rate of the frames. Informational, set by the producer.
+-- write_index:		Number of frames written by the producer. Wraps around at 2^32.
+-- read_index:		Number of frames consumed by the consumer. Wraps around at 2^32.
+*/
+struct VRC7_CACHE_ALIGN vrc7_shm_header {
+	uint32_t magic;
+	uint32_t version;
+	uint32_t capacity;
+	uint32_t channels;
+	double sample_rate;
+	uint8_t reserved[40];
+
+	//Producer and consumer indices are kept on separate cache lines
+	volatile uint32_t write_index;
+	uint8_t padding0[60];
+	volatile uint32_t read_index;
+	uint8_t padding1[60];
+};
+
+/*
+Operating system handles of a ring: file descriptors on POSIX systems, HANDLEs on Windows. event is -1 if there is none.
+*/
+struct vrc7_shm_handles {
+	intptr_t memory;
+	intptr_t event;
+};
+
+/*
+One side of a ring. Each process has its own.
+-- header:		The shared header.
+-- frames:		The shared frames.
+-- capacity:	Number of frames in the ring.
+-- channels:	Samples per frame.
+-- handles:		Handles of the shared memory and the event in this process.
+*/
+struct vrc7_shm {
+	//Read only:
+	struct vrc7_shm_header *header;
+	int16_t *frames;
+	uint32_t capacity;
+	uint32_t channels;
+	struct vrc7_shm_handles handles;
+
+	//private:
+	size_t size;
+};
+
+/*
+Producer: creates a ring of capacity frames (rounded up to a power of two) with channels samples per frame (1 or 2).
+Returns NULL if the shared memory or the event could not be created.
+*/
+VRC7SOUND_API struct vrc7_shm *vrc7_shm_create(uint32_t capacity, uint32_t channels, double sample_rate);
+
+/*
+Consumer: maps the ring described by handles, which have to be valid in this process. The ring takes ownership of the handles.
+Returns NULL if they do not refer to a valid ring.
+*/
+VRC7SOUND_API struct vrc7_shm *vrc7_shm_open(const struct vrc7_shm_handles *handles);
+
+/*
+Unmaps the ring and closes its handles. The memory is freed when both sides have closed it.
+*/
+VRC7SOUND_API void vrc7_shm_close(struct vrc7_shm *shm);
+
+/*
+Producer: returns the number of frames that can be written without overwriting unread ones.
+*/
+VRC7SOUND_API uint32_t vrc7_shm_free_frames(struct vrc7_shm *shm);
+
+/*
+Producer: renders up to frames frames with vrc7_fetch_sample directly into the ring and publishes them. Stops early if the ring is full.
+Returns the number of frames rendered.
+*/
+VRC7SOUND_API uint32_t vrc7_shm_render(struct vrc7_shm *shm, struct vrc7_sound *vrc7_s, uint32_t frames);
+
+/*
+Producer: copies up to count frames (with the ring's number of channels) into the ring and publishes them, e.g. the output of
+vrc7_run_clocks. Stops early if the ring is full. Returns the number of frames copied.
+*/
+VRC7SOUND_API uint32_t vrc7_shm_write(struct vrc7_shm *shm, const int16_t *frames, uint32_t count);
+
+/*
+Consumer: returns the number of frames that are ready to be read.
+*/
+VRC7SOUND_API uint32_t vrc7_shm_available(struct vrc7_shm *shm);
+
+/*
+Consumer: returns the oldest unread frames in place and stores their number in frames. Only the frames up to the end of the ring are
+returned, call it again after vrc7_shm_consume to get the rest.
+*/
+VRC7SOUND_API const int16_t *vrc7_shm_peek(struct vrc7_shm *shm, uint32_t *frames);
+
+/*
+Consumer: marks the oldest frames frames as read, so the producer can write over them.
+*/
+VRC7SOUND_API void vrc7_shm_consume(struct vrc7_shm *shm, uint32_t frames);
+
+/*
+Consumer: waits until at least min_frames frames are available or timeout_ms milliseconds have passed.
+Returns true if the frames are available.
+*/
+VRC7SOUND_API bool vrc7_shm_wait(struct vrc7_shm *shm, uint32_t min_frames, uint32_t timeout_ms);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif
@@ -33,25 +33,28 @@ Lagrange point filter analysis by kevtris:
 	http://forums.nesdev.com/viewtopic.php?t=4709&p=41523
 */
 
+//posix_memalign is only declared for POSIX sources
+#if !defined(_WIN32) && !defined(_POSIX_C_SOURCE)
+#define _POSIX_C_SOURCE 200112L
+#endif
+
 #include "vrc7_sound.h"
+#include "vrc7_platform.h"
+#include "vrc7_core.h"
 
 #include <math.h>
+#include <stdio.h>
 #include <stdlib.h>
+#include <string.h>
 
 #define BIT_TEST(a,b) ((a & (1<<(b)))!=0)
 
-#define PI 3.141592653589793238462643383279502884197169399
-
 /*
 ==================================================
          VRC7 SOUND TABLES & CONSTANTS
 ==================================================
 */
 
-#define LOGSIN_TABLE_LEN 256
-#define EXP_TABLE_LEN 256
-#define FAST_EXP_TABLE_LEN 4096
-
 #define VRC7_NUM_PATCH_SETS 9
 
 //1 + 240,000 / 4,300
@@ -87,8 +90,8 @@ static const uint8_t DEFAULT_INST[VRC7_NUM_PATCH_SETS][(16 + 3) * 16] = {
   },
 };
 
-//Operator/Phase Generator constants
-static const double MULT[16] = {0.125, 0.25, 0.5, 0.75, 1.0, 1.25, 1.5, 1.75, 2.0, 2.25, 2.5, 2.5, 3.0, 3.0, 3.75, 3.75};
+//Operator/Phase Generator constants. The multipliers are 0.125 to 3.75, multiplied by 8 so the values can be used in integer math
+static const uint32_t MULT_X8[16] = { 1, 2, 4, 6, 8, 10, 12, 14, 16, 18, 20, 20, 24, 24, 30, 30 };
 
 static const int8_t FEEDBACK_SHIFT[8] = { 7, 6, 5, 4, 3, 2, 1, 0 };
 
@@ -108,65 +111,350 @@ static const uint32_t TYPE_SCHEDULE[18] = { MODULATOR,MODULATOR,
 
 static const uint32_t CHANNEL_SCHEDULE[18] = { 1,2,0,1,2,3,4,5,3,4,5,6,7,8,6,7,8,0 };
 
-//Envelope constants
-static const bool ENV_TABLE[4][4] = {
-	{false,false,false,false},
-	{true ,false,false,false},
-	{true ,false,true ,false},
-	{true ,true ,true ,false},
-};
+//Rhythm mode (YM2413 only)
+#define RHYTHM_FIRST_CHANNEL 6
 
-#define ENV_PERCUSSIVE_RATE 7
-#define ENV_SUSTAINED_RATE 5
-#define ENV_DAMPING_RATE 12
+//Bit of register $0E that keys each slot of channels 6-8: BD, HH/SD, TOM/CYM
+static const uint32_t RHYTHM_KEY_BIT[3][2] = { {4,4}, {0,3}, {2,1} };
 
-enum env_stages {
-	ENV_ATTACK=0,	//Attack phase
-	ENV_DECAY,		//Above sustain level
-	ENV_RELEASE,	//Below sustain level, trigger on
-	ENV_DAMPING		//trigger off
-};
+#ifdef VRC7_SOUND_FIXED_POINT
+//Fixed-point formats of the filter coefficients, filter outputs and stereo gains
+#define FILTER_COEFF_SHIFT 30
+#define FILTER_OUTPUT_SHIFT 16
+#define GAIN_SHIFT 16
+
+//Output gains of the filters in Q16 format
+#define FILTER_GAIN ((int64_t)(VRC7_AMPLIFIER_GAIN * 256 * (1 << FILTER_OUTPUT_SHIFT)))
+#define FILTER_GAIN_FAST ((int64_t)(VRC7_AMPLIFIER_GAIN * 3.35 * (1 << FILTER_OUTPUT_SHIFT)))
+#endif
 
 //Lookup tables
-static uint32_t logsin[LOGSIN_TABLE_LEN];
+static uint32_t logsin[VRC7_LOGSIN_TABLE_LEN];
 
-static uint16_t fast_exp[FAST_EXP_TABLE_LEN];
+static uint16_t fast_exp[VRC7_FAST_EXP_TABLE_LEN];
+
+//Envelope increments selected by each combination of envelope conditions: inc1 (bit 0), inc2 (1), inc3 (2), inc4 (3)
+static uint8_t env_inc_masks[VRC7_ENV_INC_INDEX_LEN];
+
+//Decoded versions of DEFAULT_INST
+static struct vrc7_patch_bank default_banks[VRC7_NUM_PATCH_SETS];
+
+static void load_bank(const uint8_t *data, uint32_t stride, uint32_t count, struct vrc7_patch_bank *bank);
+static int16_t filter_lagrange_point_step(int16_t input, vrc7_filter_value fir, vrc7_filter_value iir, vrc7_filter_value *prev_input, vrc7_filter_value *prev_output);
 
 static void make_tables(void) {
-	//Make sure the function only creates the tables once
-	static bool tables_initialized = false;
-	if (tables_initialized)
+	//Make sure the function only creates the tables once, even if several threads create chips at the same time.
+	//0: not created, 1: being created by another thread, 2: done
+	static volatile uint32_t tables_state = 0;
+	if (vrc7_atomic_load_acquire(&tables_state) == 2)
+		return;
+	if (!vrc7_atomic_compare_swap(&tables_state, 0, 1)) {
+		while (vrc7_atomic_load_acquire(&tables_state) != 2)
+			vrc7_thread_yield();
 		return;
+	}
 
-	int *exp = malloc(EXP_TABLE_LEN * sizeof(int));
+	vrc7_core_make_tables(logsin, fast_exp, env_inc_masks);
 
-	for (int i = 0; i < LOGSIN_TABLE_LEN; i++) {
-		logsin[i] = (int)round(-log2(sin(((double)i + 0.5)*PI / 512.0))*256.0);
-		exp[i] = (int)round((pow(2, (double)i / 256.0) - 1) * 1024);
+	for (int i = 0; i < VRC7_NUM_PATCH_SETS; i++) {
+		load_bank(DEFAULT_INST[i], 16, VRC7_NUM_PATCHES + VRC7_NUM_RHYTHM_PATCHES, &default_banks[i]);
 	}
 
-	//Create a larger lookup table to speed up computation of the exp value at the expense of more memory
-	for (uint32_t i = 0; i < FAST_EXP_TABLE_LEN; i++) {
-		int shift = i >> 8;
-		int index = ~i & 0xff;
-		if (shift > 12) {
-			fast_exp[i] = 0;
-		}else {
-			int linear = exp[index];
-			linear += 1024;
-			linear >>= shift;
-			fast_exp[i] = linear & 0x7ff;
-		}
+	vrc7_atomic_store_release(&tables_state, 2);
+}
+
+/*
+==================================================
+             VRC7 SIGNAL KERNELS
+==================================================
+*/
+
+/*
+Loops over whole chunks of VRC7_SIGNAL_CHUNK_LENGTH samples. Every implementation gives the same results; sums wrap around like the
+int16_t accumulators of the scalar code. One set is selected for all objects, see vrc7_set_kernel.
+*/
+struct signal_kernels {
+	int type;
+	void (*clear)(int16_t *signal);
+	void (*fill)(int16_t *signal, int16_t value);
+	int16_t (*sum)(const int16_t *signal);
+	void (*add)(int16_t *dest, const int16_t *src);
+	void (*spread)(int16_t *signal, const int16_t *values);	//Writes values[i] to signal[i * 4] and zeros in between
+};
+
+static void clear_scalar(int16_t *signal) {
+	memset(signal, 0, VRC7_SIGNAL_CHUNK_LENGTH * sizeof(int16_t));
+}
+
+static void fill_scalar(int16_t *signal, int16_t value) {
+	for (int j = 0; j < VRC7_SIGNAL_CHUNK_LENGTH; j++) {
+		signal[j] = value;
+	}
+}
+
+static int16_t sum_scalar(const int16_t *signal) {
+	int16_t sum = 0;
+	for (int j = 0; j < VRC7_SIGNAL_CHUNK_LENGTH; j++) {
+		sum += signal[j];
+	}
+	return sum;
+}
+
+static void add_scalar(int16_t *dest, const int16_t *src) {
+	for (int j = 0; j < VRC7_SIGNAL_CHUNK_LENGTH; j++) {
+		dest[j] += src[j];
+	}
+}
+
+static void spread_scalar(int16_t *signal, const int16_t *values) {
+	for (int i = 0; i < VRC7_SIGNAL_CHUNK_LENGTH / 4; i++) {
+		signal[i * 4] = values[i];
+		signal[i * 4 + 1] = signal[i * 4 + 2] = signal[i * 4 + 3] = 0;
+	}
+}
+
+static const struct signal_kernels kernels_scalar = {
+	VRC7_KERNEL_SCALAR, clear_scalar, fill_scalar, sum_scalar, add_scalar, spread_scalar
+};
+
+#if defined(_M_X64) || defined(_M_IX86) || defined(__x86_64__) || defined(__i386__)
+#define VRC7_KERNELS_X86
+
+//The SIMD kernels are compiled for their instruction set regardless of the compiler flags and only called if the CPU supports it
+#ifdef _MSC_VER
+#define KERNEL_TARGET(isa)
+#else
+#include <immintrin.h>
+#define KERNEL_TARGET(isa) __attribute__((target(isa)))
+#endif
+
+//72 samples are 9 SSE2 vectors or 4 AVX2 vectors and one SSE2 vector
+#define SSE2_VECTORS (VRC7_SIGNAL_CHUNK_LENGTH / 8)
+#define AVX2_VECTORS (VRC7_SIGNAL_CHUNK_LENGTH / 16)
+
+KERNEL_TARGET("sse2") static void clear_sse2(int16_t *signal) {
+	__m128i zero = _mm_setzero_si128();
+	for (int i = 0; i < SSE2_VECTORS; i++) {
+		_mm_storeu_si128((__m128i *)signal + i, zero);
+	}
+}
+
+KERNEL_TARGET("sse2") static void fill_sse2(int16_t *signal, int16_t value) {
+	__m128i fill = _mm_set1_epi16(value);
+	for (int i = 0; i < SSE2_VECTORS; i++) {
+		_mm_storeu_si128((__m128i *)signal + i, fill);
+	}
+}
+
+KERNEL_TARGET("sse2") static int16_t reduce_sse2(__m128i sum) {
+	sum = _mm_add_epi16(sum, _mm_srli_si128(sum, 8));
+	sum = _mm_add_epi16(sum, _mm_srli_si128(sum, 4));
+	sum = _mm_add_epi16(sum, _mm_srli_si128(sum, 2));
+	return (int16_t)_mm_cvtsi128_si32(sum);
+}
+
+KERNEL_TARGET("sse2") static int16_t sum_sse2(const int16_t *signal) {
+	__m128i sum = _mm_setzero_si128();
+	for (int i = 0; i < SSE2_VECTORS; i++) {
+		sum = _mm_add_epi16(sum, _mm_loadu_si128((const __m128i *)signal + i));
+	}
+	return reduce_sse2(sum);
+}
+
+KERNEL_TARGET("sse2") static void add_sse2(int16_t *dest, const int16_t *src) {
+	for (int i = 0; i < SSE2_VECTORS; i++) {
+		__m128i sum = _mm_add_epi16(_mm_loadu_si128((const __m128i *)dest + i), _mm_loadu_si128((const __m128i *)src + i));
+		_mm_storeu_si128((__m128i *)dest + i, sum);
+	}
+}
+
+/*
+Interleaving with zeros twice turns 4 values into 16 samples: v0 0 0 0 v1 0 0 0 ...
+*/
+KERNEL_TARGET("sse2") static void spread4_sse2(__m128i *out, __m128i values) {
+	__m128i zero = _mm_setzero_si128();
+	__m128i words = _mm_unpacklo_epi16(values, zero);
+	_mm_storeu_si128(out, _mm_unpacklo_epi32(words, zero));
+	_mm_storeu_si128(out + 1, _mm_unpackhi_epi32(words, zero));
+}
+
+KERNEL_TARGET("sse2") static void spread_sse2(int16_t *signal, const int16_t *values) {
+	__m128i *out = (__m128i *)signal;
+	for (int i = 0; i < 2; i++) {
+		__m128i block = _mm_loadu_si128((const __m128i *)values + i);
+		spread4_sse2(out + i * 4, block);
+		spread4_sse2(out + i * 4 + 2, _mm_srli_si128(block, 8));
 	}
 
-	free(exp);
-	tables_initialized = true;
+	//Values 16 and 17
+	int32_t last;
+	memcpy(&last, &values[16], sizeof(last));
+	__m128i words = _mm_unpacklo_epi16(_mm_cvtsi32_si128(last), _mm_setzero_si128());
+	_mm_storeu_si128(out + 8, _mm_unpacklo_epi32(words, _mm_setzero_si128()));
 }
 
-static inline uint32_t phase_to_logsin(uint32_t phase) {
-	if (BIT_TEST(phase, 8))
-		phase = ~phase;
-	return logsin[phase & 0xff];
+static const struct signal_kernels kernels_sse2 = {
+	VRC7_KERNEL_SSE2, clear_sse2, fill_sse2, sum_sse2, add_sse2, spread_sse2
+};
+
+KERNEL_TARGET("avx2") static void clear_avx2(int16_t *signal) {
+	__m256i zero = _mm256_setzero_si256();
+	for (int i = 0; i < AVX2_VECTORS; i++) {
+		_mm256_storeu_si256((__m256i *)signal + i, zero);
+	}
+	_mm_storeu_si128((__m128i *)signal + AVX2_VECTORS * 2, _mm256_castsi256_si128(zero));
+}
+
+KERNEL_TARGET("avx2") static void fill_avx2(int16_t *signal, int16_t value) {
+	__m256i fill = _mm256_set1_epi16(value);
+	for (int i = 0; i < AVX2_VECTORS; i++) {
+		_mm256_storeu_si256((__m256i *)signal + i, fill);
+	}
+	_mm_storeu_si128((__m128i *)signal + AVX2_VECTORS * 2, _mm256_castsi256_si128(fill));
+}
+
+KERNEL_TARGET("avx2") static int16_t sum_avx2(const int16_t *signal) {
+	__m256i sum = _mm256_setzero_si256();
+	for (int i = 0; i < AVX2_VECTORS; i++) {
+		sum = _mm256_add_epi16(sum, _mm256_loadu_si256((const __m256i *)signal + i));
+	}
+	__m128i half = _mm_add_epi16(_mm256_castsi256_si128(sum), _mm256_extracti128_si256(sum, 1));
+	half = _mm_add_epi16(half, _mm_loadu_si128((const __m128i *)signal + AVX2_VECTORS * 2));
+	return reduce_sse2(half);
+}
+
+KERNEL_TARGET("avx2") static void add_avx2(int16_t *dest, const int16_t *src) {
+	for (int i = 0; i < AVX2_VECTORS; i++) {
+		__m256i sum = _mm256_add_epi16(_mm256_loadu_si256((const __m256i *)dest + i), _mm256_loadu_si256((const __m256i *)src + i));
+		_mm256_storeu_si256((__m256i *)dest + i, sum);
+	}
+	__m128i *dest_tail = (__m128i *)dest + AVX2_VECTORS * 2;
+	_mm_storeu_si128(dest_tail, _mm_add_epi16(_mm_loadu_si128(dest_tail), _mm_loadu_si128((const __m128i *)src + AVX2_VECTORS * 2)));
+}
+
+//Spreading only shuffles 18 values, AVX2 has nothing to add to the SSE2 version
+static const struct signal_kernels kernels_avx2 = {
+	VRC7_KERNEL_AVX2, clear_avx2, fill_avx2, sum_avx2, add_avx2, spread_sse2
+};
+#endif
+
+//Selected vrc7_kernel_types value, VRC7_KERNEL_AUTO until the first selection. Shared by all threads, so only accessed atomically.
+static volatile uint32_t selected_kernel = VRC7_KERNEL_AUTO;
+
+static bool cpu_supports(int type) {
+	switch (type) {
+	case VRC7_KERNEL_SCALAR:
+		return true;
+#ifdef VRC7_KERNELS_X86
+#ifdef _MSC_VER
+	case VRC7_KERNEL_SSE2: {
+		int info[4];
+		__cpuid(info, 1);
+		return BIT_TEST(info[3], 26);
+	}
+	case VRC7_KERNEL_AVX2: {
+		//AVX2 also needs the OS to save the upper halves of the registers
+		int info[4];
+		__cpuid(info, 0);
+		if (info[0] < 7)
+			return false;
+		__cpuid(info, 1);
+		if (!BIT_TEST(info[2], 27) || !BIT_TEST(info[2], 28) || (_xgetbv(0) & 6) != 6)
+			return false;
+		__cpuidex(info, 7, 0);
+		return BIT_TEST(info[1], 5);
+	}
+#else
+	case VRC7_KERNEL_SSE2:
+		__builtin_cpu_init();
+		return __builtin_cpu_supports("sse2");
+	case VRC7_KERNEL_AVX2:
+		__builtin_cpu_init();
+		return __builtin_cpu_supports("avx2");
+#endif
+#endif
+	default:
+		return false;
+	}
+}
+
+static const struct signal_kernels *get_kernels(int type) {
+	switch (type) {
+#ifdef VRC7_KERNELS_X86
+	case VRC7_KERNEL_SSE2:
+		return &kernels_sse2;
+	case VRC7_KERNEL_AVX2:
+		return &kernels_avx2;
+#endif
+	default:
+		return &kernels_scalar;
+	}
+}
+
+/*
+Returns the selected kernels. Falls back to the scalar ones if none were selected yet.
+*/
+static inline const struct signal_kernels *current_kernels(void) {
+	return get_kernels((int)vrc7_atomic_load_acquire(&selected_kernel));
+}
+
+/*
+Returns the best kernels the CPU supports.
+*/
+static int find_auto_kernel(void) {
+	int kernel = VRC7_KERNEL_SCALAR;
+	if (cpu_supports(VRC7_KERNEL_SSE2))
+		kernel = VRC7_KERNEL_SSE2;
+	if (cpu_supports(VRC7_KERNEL_AVX2))
+		kernel = VRC7_KERNEL_AVX2;
+	return kernel;
+}
+
+/*
+Selects the kernels on first use. The environment variable VRC7_SOUND_KERNEL (scalar, sse2 or avx2) overrides the automatic choice.
+Several threads may get here at once: only the first selection is kept, a kernel chosen with vrc7_set_kernel in the meantime wins.
+*/
+static void init_kernels(void) {
+	if (vrc7_atomic_load_acquire(&selected_kernel) != VRC7_KERNEL_AUTO)
+		return;
+
+	char name[16] = { 0 };
+#ifdef _MSC_VER
+	size_t length;
+	if (getenv_s(&length, name, sizeof(name), "VRC7_SOUND_KERNEL") != 0)
+		name[0] = 0;
+#else
+	const char *value = getenv("VRC7_SOUND_KERNEL");
+	if (value)
+		strncpy(name, value, sizeof(name) - 1);
+#endif
+
+	int type = VRC7_KERNEL_AUTO;
+	if (strcmp(name, "scalar") == 0)
+		type = VRC7_KERNEL_SCALAR;
+	else if (strcmp(name, "sse2") == 0)
+		type = VRC7_KERNEL_SSE2;
+	else if (strcmp(name, "avx2") == 0)
+		type = VRC7_KERNEL_AVX2;
+
+	if (type == VRC7_KERNEL_AUTO || !cpu_supports(type))
+		type = find_auto_kernel();
+	vrc7_atomic_compare_swap(&selected_kernel, VRC7_KERNEL_AUTO, (uint32_t)type);
+}
+
+VRC7SOUND_API bool vrc7_set_kernel(int kernel) {
+	if (kernel == VRC7_KERNEL_AUTO)
+		kernel = find_auto_kernel();
+	if (!cpu_supports(kernel))
+		return false;
+
+	vrc7_atomic_store_release(&selected_kernel, (uint32_t)kernel);
+	return true;
+}
+
+VRC7SOUND_API int vrc7_get_kernel(void) {
+	init_kernels();
+	return (int)vrc7_atomic_load_acquire(&selected_kernel);
 }
 
 /*
@@ -175,21 +463,10 @@ static inline uint32_t phase_to_logsin(uint32_t phase) {
 ==================================================
 */
 
-static int32_t calc_vibrato(uint32_t vibrato_counter, uint32_t fNum, uint32_t octave) {
-	int32_t vib_value = 0;
-	if (BIT_TEST(vibrato_counter, 11))
-		vib_value = fNum >> 6;
-	else if (BIT_TEST(vibrato_counter, 10))
-		vib_value = fNum >> 7;
-	if (BIT_TEST(vibrato_counter, 12))
-		vib_value = -vib_value;
-	return vib_value<<(octave+1);
-}
-
-static uint32_t calc_phase_inc(uint32_t fNum, uint32_t octave, uint32_t mult) {
-	//Calculate phase increment
-	int phase_inc = fNum << (octave + 2);
-	return (int)(phase_inc*MULT[mult]);
+static uint32_t calc_phase_inc(uint32_t fNum, uint32_t octave, uint32_t mult_x8) {
+	//Calculate phase increment. All MULT values are multiples of 1/8, so this is exact.
+	uint32_t phase_inc = fNum << (octave + 2);
+	return (phase_inc * mult_x8) >> 3;
 }
 
 static uint32_t calc_ksl(uint32_t fNum, uint32_t octave, uint32_t ksl_index) {
@@ -208,68 +485,70 @@ static uint32_t calc_envelope_rate_low(uint32_t fNum, uint32_t octave, bool ksr)
 	return ksr_inc & 0b11;
 }
 
-static uint32_t calc_envelope_rate_high(struct vrc7_channel *channel, struct vrc7_patch *patch, uint32_t type, uint32_t env_stage) {
-	//key rate scaling
-	uint32_t key_scale = 0;
-	if (patch->key_scale_rate[type])
-		key_scale = channel->octave >> 1;
+static uint32_t calc_envelope_rate_high(struct vrc7_channel *channel, struct vrc7_patch *patch, struct vrc7_patch_derived *derived, uint32_t type, uint32_t env_stage, bool key) {
+	return vrc7_core_envelope_rate_high(patch, type, derived->key_scale[type][channel->octave], env_stage, key, channel->sustain);
+}
 
-	//Set rate based on current envelope stage
-	uint32_t rate_high = 0;
-	switch (env_stage) {
-	case ENV_ATTACK: 
-		rate_high = patch->attack_rate[type] + key_scale;
-		break;
-	case ENV_DECAY:
-		rate_high = patch->decay_rate[type] + key_scale;
-		break;
-	case ENV_RELEASE: 
-		if (patch->sustained[type])	//Envelope sustaining
-			rate_high = 0;
-		else
-			rate_high = patch->release_rate[type] + key_scale;
-		break;
-	case ENV_DAMPING: 
-		if (channel->trigger)	//Key on, get envelope ready
-			rate_high = ENV_DAMPING_RATE + key_scale;
-		else {
-			if (channel->sustain)
-				rate_high = ENV_SUSTAINED_RATE + key_scale;
-			else if (!patch->sustained[type])
-				rate_high = ENV_PERCUSSIVE_RATE + key_scale;
-			else
-				rate_high = patch->release_rate[type] + key_scale;	//Non-percussive release
+static void derive_patch(const struct vrc7_patch *patch, struct vrc7_patch_derived *derived) {
+	derived->feedback_shift = FEEDBACK_SHIFT[patch->feedback];
+	for (int i = 0; i < 2; i++) {
+		int type = i == 0 ? MODULATOR : CARRIER;
+		derived->mult_x8[type] = MULT_X8[patch->mult[type]];
+
+		//Key dependent values. Key level scaling is stored as 0 when disabled, so it can always be added.
+		for (uint32_t key = 0; key < VRC7_NUM_KEYS_KSL; key++) {
+			uint32_t ksl = calc_ksl((key & 0x0f) << 5, key >> 4, patch->key_scale_level[type]);
+			derived->ksl[type][key] = patch->key_scale_level[type] != 0 ? (uint8_t)ksl : 0;
+		}
+		for (uint32_t key = 0; key < VRC7_NUM_KEYS_RATE; key++) {
+			derived->rate_low[type][key] = (uint8_t)calc_envelope_rate_low((key & 1) << 8, key >> 1, patch->key_scale_rate[type]);
+		}
+		for (uint32_t octave = 0; octave < 8; octave++) {
+			derived->key_scale[type][octave] = patch->key_scale_rate[type] ? (uint8_t)(octave >> 1) : 0;
 		}
-		break;
 	}
-	return min(rate_high,15);
 }
 
-static int32_t calc_operator(uint32_t phase, int32_t mod_phase, uint32_t volume,bool rect) {
-	//Calculate final phase value
-	phase = ((phase >> 9) + mod_phase) & 0x3ff;
+static void load_bank(const uint8_t *data, uint32_t stride, uint32_t count, struct vrc7_patch_bank *bank) {
+	for (uint32_t i = 0; i < count; i++) {
+		vrc7_reg_to_patch(data + i * stride, &bank->patches[i]);
+		derive_patch(&bank->patches[i], &bank->derived[i]);
+	}
+}
 
-	//Calculate logsin value
-	uint32_t logsin_val = phase_to_logsin(phase);
-	logsin_val += volume << 4;
+/*
+Returns the index of the patch used by a channel. In rhythm mode, channels 6-8 use the rhythm patches.
+*/
+static inline uint32_t get_patch_index(struct vrc7_sound *vrc7_s, uint32_t ch) {
+	if (vrc7_s->rhythm && ch >= RHYTHM_FIRST_CHANNEL)
+		return VRC7_NUM_PATCHES + ch - RHYTHM_FIRST_CHANNEL;
+	return vrc7_s->channels[ch]->instrument;
+}
 
-	int32_t output;
+/*
+Returns whether a slot is keyed on. In rhythm mode, the rhythm key bits are combined with the channel's trigger bit.
+*/
+static inline bool get_slot_key(struct vrc7_sound *vrc7_s, uint32_t ch, uint32_t type) {
+	return vrc7_s->channels[ch]->trigger
+		|| (vrc7_s->rhythm && ch >= RHYTHM_FIRST_CHANNEL && BIT_TEST(vrc7_s->rhythm_keys, RHYTHM_KEY_BIT[ch - RHYTHM_FIRST_CHANNEL][type]));
+}
 
-	//Set output to 0 if value is too big
-	if (logsin_val >= (1 << 12)) {
-		output = 0;
-	}else {
-		output = fast_exp[logsin_val];
+/*
+Restarts the envelopes of all slots of a channel that were keyed on since prev_keys was taken.
+*/
+static void update_keys(struct vrc7_sound *vrc7_s, uint32_t ch, const bool *prev_keys) {
+	for (int i = 0; i < 2; i++) {
+		int type = i == 0 ? MODULATOR : CARRIER;
+		if (!prev_keys[type] && get_slot_key(vrc7_s, ch, type))
+			vrc7_s->channels[ch]->slots[type]->restart_env = true;
 	}
+}
 
-	//Invert or zero output when sign bit is set
-	if (BIT_TEST(phase, 9)) {
-		if (rect)
-			output = 0;
-		else
-			output = ~output;
-	}
-	return output;
+/*
+Calculates the phase of the HH, SD and CYM rhythm instruments, which is generated from the phases of HH and CYM and the noise generator.
+*/
+static uint32_t calc_rhythm_phase(struct vrc7_sound *vrc7_s, uint32_t ch, uint32_t type) {
+	return vrc7_core_rhythm_phase(vrc7_s->channels[7]->slots[MODULATOR]->phase, vrc7_s->channels[8]->slots[CARRIER]->phase, vrc7_s->noise, ch, type);
 }
 
 /*
@@ -277,112 +556,37 @@ Reloads the envelope rate when the envelope stage changes.
 */
 static void set_envelope_stage(struct vrc7_sound *vrc7_s,uint32_t ch, uint32_t type, uint32_t stage) {
 	struct vrc7_channel *channel = vrc7_s->channels[ch];
-	struct vrc7_patch *patch = vrc7_s->patches[channel->instrument];
+	uint32_t patch_index = get_patch_index(vrc7_s, ch);
+	struct vrc7_patch *patch = vrc7_s->patches[patch_index];
+	struct vrc7_patch_derived *derived = vrc7_s->derived[patch_index];
 	struct vrc7_slot *slot = channel->slots[type];
 
 	//Calculate new high rates
 	slot->env_stage = stage;
-	slot->env_rate_high = calc_envelope_rate_high(channel, patch, type, stage);
+	slot->env_rate_high = calc_envelope_rate_high(channel, patch, derived, type, stage, get_slot_key(vrc7_s, ch, type));
 }
 
 static void update_envelope(struct vrc7_sound *vrc7_s, uint32_t ch,uint32_t type) {
 	struct vrc7_channel *channel = vrc7_s->channels[ch];
-	struct vrc7_patch *patch = vrc7_s->patches[channel->instrument];
+	struct vrc7_patch *patch = vrc7_s->patches[get_patch_index(vrc7_s, ch)];
 	struct vrc7_slot *slot = channel->slots[type];
 	
 	uint32_t rate_high = slot->env_rate_high;
-	uint32_t rate_low = slot->env_rate_low;
 	bool env_enabled = slot->env_enabled;
 
-	//Check whether to update the envelope 'naturally'
-	bool clock_envelope = false;
-	if (rate_high != 0 && rate_high < 12) {
-		if (rate_high + vrc7_s->zero_count == 12)
-			clock_envelope = true;
-		else if (rate_high + vrc7_s->zero_count == 13 && BIT_TEST(rate_low, 1))
-			clock_envelope = true;
-		else if (rate_high + vrc7_s->zero_count == 14 && BIT_TEST(rate_low, 0))
-			clock_envelope = true;
-	}
-
-	//Get various flags
-	bool env_table = ENV_TABLE[rate_low][vrc7_s->envelope_counter & 3];
-	bool mini_zero = vrc7_s->mini_counter == 0;
-	bool mini_odd = (vrc7_s->mini_counter & 1) == 0;
-
-	//Setup the four different increment values
-	int inc1 = slot->env_stage == ENV_ATTACK ? (~slot->env_value + 1) >> 1 : 0;
-	int inc2 = slot->env_stage == ENV_ATTACK ? (~slot->env_value + 1) >> 2 : 0;
-	int inc3 = slot->env_stage == ENV_ATTACK ? (~slot->env_value + 1) >> 3 : 0;
-	int inc4 = slot->env_stage == ENV_ATTACK ? (~slot->env_value + 1) >> 4 : 0;
-	if (env_enabled) {
-		inc1 |= 2;
-		inc2 |= 1;
-	}
-	
-	//Compute envelope increment based on previous stuff
-	int env_inc = 0;
-
-	if (clock_envelope || !env_table && rate_high == 12)
-		env_inc |= inc4;
-
-	if (!env_table && rate_high == 13 || env_table && rate_high == 12)
-		env_inc |= inc3;
-
-	if (clock_envelope && mini_zero && env_enabled
-			|| rate_high == 14 && !env_table
-			|| rate_high == 13 && env_table
-			|| rate_high == 13 && !env_table && mini_odd && env_enabled
-			|| rate_high == 12 && !env_table && mini_zero && env_enabled
-			|| rate_high == 12 && env_table && mini_odd && env_enabled)
-		env_inc |= inc2;
-
-	if (rate_high == 15 || rate_high == 14 && env_table)
-		env_inc |= inc1;
-
 	//Update envelope value
+	uint32_t env_inc = vrc7_core_envelope_inc(env_inc_masks, rate_high, slot->env_rate_low, slot->env_stage, slot->env_value, env_enabled,
+		vrc7_s->zero_count, vrc7_s->envelope_counter, vrc7_s->mini_counter);
 	uint32_t env_value = (slot->env_value + env_inc) & 0x7f;
 	
-	//Update envelope stage
-	//Restart envelope
-	if (slot->restart_env) {
-		env_enabled = true;
-		set_envelope_stage(vrc7_s, ch, type, ENV_DAMPING);
-		slot->restart_env = false;
-	}
-	
-	//Skip attack phase when rate is 15
-	if (slot->env_stage == ENV_ATTACK && rate_high == 15) {
-		env_value = 0;
-		set_envelope_stage(vrc7_s, ch, type, ENV_DECAY);
-	}
-
-	//Enter decay phase when envelope peak is reached
-	if (slot->env_stage == ENV_ATTACK && env_value == 0) {
-		set_envelope_stage(vrc7_s, ch, type, ENV_DECAY);
-	}
-
-	//Exit damping phase when value is low enough
-	if (slot->env_stage == ENV_DAMPING && env_value >= 0x7c) {
-		set_envelope_stage(vrc7_s, ch, type, ENV_ATTACK);
-	}
-
-	//Check if sustain level has been reached
-	uint32_t sustain_level = patch->sustain_level[type];
-	if (slot->env_stage == ENV_DECAY && env_value >> 3 == sustain_level) {
-		set_envelope_stage(vrc7_s, ch, type, ENV_RELEASE);
-	}
-
-	//Release envelope when trigger bit is 0
-	if (slot->env_stage!=ENV_DAMPING && !channel->trigger && !(type==MODULATOR && patch->sustained[MODULATOR])) {
-		set_envelope_stage(vrc7_s, ch, type, ENV_DAMPING);
-		env_enabled = true;
-	}
-
-	//Stop incrementing envelope during the RELEASE/DAMPING phase when the value gets too big
-	if (env_enabled && env_value >= 0x7c && (slot->env_stage == ENV_RELEASE || slot->env_stage == ENV_DAMPING)) {
-		env_enabled = false;
-	}
+	//Update envelope stage. The rhythm instruments HH and TOM are modulator slots, but release like carriers.
+	bool rhythm_output = vrc7_s->rhythm && ch > RHYTHM_FIRST_CHANNEL;
+	bool hold = type == MODULATOR && patch->sustained[MODULATOR] && !rhythm_output;
+	uint32_t env_stage = vrc7_core_envelope_stage(slot->env_stage, rate_high, &env_value, &env_enabled, slot->restart_env,
+		patch->sustain_level[type], get_slot_key(vrc7_s, ch, type), hold);
+	if (env_stage != slot->env_stage || slot->restart_env)
+		set_envelope_stage(vrc7_s, ch, type, env_stage);
+	slot->restart_env = false;
 
 	slot->env_value = env_value;
 	slot->env_enabled = env_enabled;
@@ -390,33 +594,38 @@ static void update_envelope(struct vrc7_sound *vrc7_s, uint32_t ch,uint32_t type
 
 static int32_t update_slot(struct vrc7_sound *vrc7_s, uint32_t ch, uint32_t type) {
 	struct vrc7_channel *channel = vrc7_s->channels[ch];
-	struct vrc7_patch *patch = vrc7_s->patches[channel->instrument];
+	uint32_t patch_index = get_patch_index(vrc7_s, ch);
+	struct vrc7_patch *patch = vrc7_s->patches[patch_index];
+	struct vrc7_patch_derived *derived = vrc7_s->derived[patch_index];
 	struct vrc7_slot *slot = channel->slots[type];
 
+	//In rhythm mode, both slots of channels 7 and 8 are separate instruments without modulation (BD on channel 6 is a regular FM channel)
+	bool rhythm_output = vrc7_s->rhythm && ch > RHYTHM_FIRST_CHANNEL;
+
 	//Compute modulation and the first part of the volume since these values are different for modulator and carrier
 	int32_t modulation = 0;
 	int volume = 0;
 	if (type == CARRIER) {
-		modulation = channel->slots[MODULATOR]->sample<<1;
+		if (!rhythm_output)
+			modulation = channel->slots[MODULATOR]->sample<<1;
 		volume = channel->volume << 3;
+	}else if (rhythm_output) {
+		//HH and TOM take their volume from the instrument bits
+		volume = channel->instrument << 3;
 	}else {
 		//Modulator feedback
-		int8_t feedback = FEEDBACK_SHIFT[patch->feedback];
 		if (patch->feedback != 0) {
 			modulation = (slot->sample + slot->sample_prev) >> 1;
-			modulation >>= feedback;
+			modulation >>= derived->feedback_shift;
 		}
 		volume = patch->total_level << 1;
 	}
 
 	//Apply key scaling to volume level
-	if (patch->key_scale_level[type] != 0) {
-		volume += slot->ksl_val;
-	}
+	volume += slot->ksl_val;
 
 	//Add tremolo
-	if (patch->tremolo[type])
-		volume += vrc7_s->tremolo_value >> 3;
+	volume += slot->tremolo_val;
 
 	//Add envelope
 	update_envelope(vrc7_s, ch, type);
@@ -428,34 +637,60 @@ static int32_t update_slot(struct vrc7_sound *vrc7_s, uint32_t ch, uint32_t type
 	//Clamp volume
 	volume = min(volume, 0x7f);
 
+	//HH, SD and CYM replace the phase with the output of the rhythm phase generator
+	uint32_t phase = slot->phase;
+	if (rhythm_output && !(ch == 8 && type == MODULATOR))
+		phase = calc_rhythm_phase(vrc7_s, ch, type) << 9;
+
 	//Get operator value
-	int32_t output = calc_operator(slot->phase, modulation, volume, patch->rect[type]);
+	int32_t output = vrc7_core_operator(logsin, fast_exp, phase, modulation, volume, patch->rect[type]);
 	if (slot->env_value == 0x7f)	//Not sure if this will ever be reached, but if it does, the VRC7 explicitely sets the operator output to 0.
 		output = 0;
 	slot->sample_prev = slot->sample;
 	slot->sample = output;
 
 	//Update operator phase
-	int32_t vibrato_val = 0;
-	if (patch->vibrato[type])
-		vibrato_val = calc_vibrato(vrc7_s->vibrato_counter, channel->fNum, channel->octave);
-	else
-		vibrato_val = 0;
-	slot->phase += (uint32_t)(slot->phase_inc + MULT[patch->mult[type]] * vibrato_val);
+	slot->phase += slot->phase_step;
 
 	return output;
 }
 
-static void update_fmam(struct vrc7_sound *vrc7_s) {
-	//Update vibrato counter
-	vrc7_s->vibrato_counter++;
+/*
+Updates the vibrato and tremolo values of a channel's slots from the current LFO state.
+*/
+static void update_channel_lfo(struct vrc7_sound *vrc7_s, uint32_t ch) {
+	struct vrc7_channel *channel = vrc7_s->channels[ch];
+	uint32_t patch_index = get_patch_index(vrc7_s, ch);
+	struct vrc7_patch *patch = vrc7_s->patches[patch_index];
+	struct vrc7_patch_derived *derived = vrc7_s->derived[patch_index];
+
+	for (int i = 0; i < 2; i++) {
+		int type = i == 0 ? MODULATOR : CARRIER;
+		struct vrc7_slot *slot = channel->slots[type];
+		int32_t vibrato_val = 0;
+		if (patch->vibrato[type])
+			vibrato_val = vrc7_core_calc_vibrato(vrc7_s->vibrato_counter, channel->fNum, channel->octave);
+		slot->phase_step = slot->phase_inc + (((int32_t)derived->mult_x8[type] * vibrato_val) >> 3);
+		slot->tremolo_val = patch->tremolo[type] ? vrc7_s->tremolo_value >> 3 : 0;
+	}
+}
+
+/*
+The cached slot values only have to be updated when this changes.
+*/
+static inline uint32_t get_lfo_step(struct vrc7_sound *vrc7_s) {
+	return vrc7_core_lfo_step(vrc7_s->vibrato_counter, vrc7_s->tremolo_value);
+}
 
-	//Update tremolo value/increment
-	if ((vrc7_s->vibrato_counter & 0x3f) == 0) {
-		vrc7_s->tremolo_value += vrc7_s->tremolo_inc;
-		if (vrc7_s->tremolo_value >= 0x69 || vrc7_s->tremolo_value <= 0)
-			vrc7_s->tremolo_inc *= -1;
+static void update_lfo(struct vrc7_sound *vrc7_s) {
+	vrc7_s->lfo_step = get_lfo_step(vrc7_s);
+	for (uint32_t i = 0; i < vrc7_s->num_channels; i++) {
+		update_channel_lfo(vrc7_s, i);
 	}
+}
+
+static void update_fmam(struct vrc7_sound *vrc7_s) {
+	vrc7_core_update_fmam(&vrc7_s->vibrato_counter, &vrc7_s->tremolo_value, &vrc7_s->tremolo_inc);
 
 #ifdef VRC7_SOUND_TEST_REG
 	if (vrc7_s->test_reset_fmam) {
@@ -464,27 +699,13 @@ static void update_fmam(struct vrc7_sound *vrc7_s) {
 		vrc7_s->tremolo_inc = 1;
 	}
 #endif
+
+	if (get_lfo_step(vrc7_s) != vrc7_s->lfo_step)
+		update_lfo(vrc7_s);
 }
 
 static void update_envelope_counters(struct vrc7_sound *vrc7_s){
-	//Update envelope counters
-	vrc7_s->mini_counter = (vrc7_s->mini_counter + 1) & 3;
-	if (vrc7_s->mini_counter == 0)
-		vrc7_s->envelope_counter++;
-
-	//Update zero count
-	vrc7_s->zero_count = 1;
-	uint32_t envelope_copy = vrc7_s->envelope_counter;
-	for (int i = 0; i < 13; i++) {
-		if ((envelope_copy & 1) == 0) {
-			vrc7_s->zero_count++;
-			envelope_copy >>= 1;
-		}
-		else
-			break;
-	}
-	if (vrc7_s->zero_count > 13)
-		vrc7_s->zero_count = 0;
+	vrc7_core_update_envelope_counters(&vrc7_s->mini_counter, &vrc7_s->envelope_counter, &vrc7_s->zero_count);
 }
 
 /*
@@ -492,56 +713,124 @@ Updates the precalculated values when the instrument changes.
 */
 static void set_instrument(struct vrc7_sound *vrc7_s, uint32_t ch, uint32_t instrument) {
 	struct vrc7_channel *channel = vrc7_s->channels[ch];
-	struct vrc7_patch *patch = vrc7_s->patches[instrument];
 	channel->instrument = instrument;
 
+	uint32_t patch_index = get_patch_index(vrc7_s, ch);
+	struct vrc7_patch *patch = vrc7_s->patches[patch_index];
+	struct vrc7_patch_derived *derived = vrc7_s->derived[patch_index];
+
 	//Instrument change affects most of the other stuff we precalculate
+	uint32_t key_ksl = (channel->octave << 4) | (channel->fNum >> 5);
+	uint32_t key_rate = (channel->octave << 1) | (channel->fNum >> 8);
 	for (int i = 0; i < 2; i++) {
 		int type = i == 0 ? MODULATOR : CARRIER;
-		channel->slots[type]->phase_inc = calc_phase_inc(channel->fNum, channel->octave, patch->mult[type]);
-		channel->slots[type]->ksl_val = calc_ksl(channel->fNum, channel->octave, patch->key_scale_level[type]);
-		channel->slots[type]->env_rate_low = calc_envelope_rate_low(channel->fNum, channel->octave, patch->key_scale_rate[type]);
-		channel->slots[type]->env_rate_high = calc_envelope_rate_high(channel, patch, type, channel->slots[type]->env_stage);
+		channel->slots[type]->phase_inc = calc_phase_inc(channel->fNum, channel->octave, derived->mult_x8[type]);
+		channel->slots[type]->ksl_val = derived->ksl[type][key_ksl];
+		channel->slots[type]->env_rate_low = derived->rate_low[type][key_rate];
+		channel->slots[type]->env_rate_high = calc_envelope_rate_high(channel, patch, derived, type, channel->slots[type]->env_stage, get_slot_key(vrc7_s, ch, type));
 	}
+	update_channel_lfo(vrc7_s, ch);
 }
 
 /*
-Updates the precalculated values when the fNum changes.
+Updates the precalculated values when the user tone register changes.
 */
-static void set_fnum(struct vrc7_sound *vrc7_s, uint32_t ch, uint32_t fNum) {
-	struct vrc7_channel *channel = vrc7_s->channels[ch];
-	struct vrc7_patch *patch = vrc7_s->patches[channel->instrument];
-	channel->fNum = fNum;
-	for (int i = 0; i < 2; i++) {
-		int type = i == 0 ? MODULATOR : CARRIER;
-		channel->slots[type]->phase_inc = calc_phase_inc(channel->fNum, channel->octave, patch->mult[type]);
-		channel->slots[type]->ksl_val = calc_ksl(channel->fNum, channel->octave, patch->key_scale_level[type]);
-		channel->slots[type]->env_rate_low = calc_envelope_rate_low(channel->fNum, channel->octave, patch->key_scale_rate[type]);
-		//Yay, don't have to update rate_high (depends only on octave, not fNum)
+static void update_user_tone(struct vrc7_sound *vrc7_s) {
+	vrc7_s->user_tone_dirty = false;
+	derive_patch(vrc7_s->patches[0], vrc7_s->derived[0]);
+
+	for (uint32_t i = 0; i < vrc7_s->num_channels; i++) {
+		if (get_patch_index(vrc7_s, i) == 0)
+			vrc7_s->dirty_channels |= 1 << i;
 	}
 }
 
 /*
-Updates the precalculated values when the octave changes.
+Register writes only store the new values and mark the affected channels or the user tone as dirty. This function
+updates the precalculated values once before the next tick, no matter how many writes happened in between.
 */
-static void set_octave(struct vrc7_sound *vrc7_s, uint32_t ch, uint32_t octave) {
-	vrc7_s->channels[ch]->octave = octave;
+static void update_dirty(struct vrc7_sound *vrc7_s) {
+	if (vrc7_s->user_tone_dirty)
+		update_user_tone(vrc7_s);
 
-	//Setting the instrument to itself, since it is the exact same code that would otherwise go here
-	set_instrument(vrc7_s, ch, vrc7_s->channels[ch]->instrument);
+	for (uint32_t i = 0; i < vrc7_s->num_channels; i++) {
+		if (BIT_TEST(vrc7_s->dirty_channels, i))
+			set_instrument(vrc7_s, i, vrc7_s->channels[i]->instrument);	//Setting the instrument to itself updates everything
+	}
+	vrc7_s->dirty_channels = 0;
 }
 
 /*
-Updates the precalculated values when the user tone register changes.
+Converts a filter coefficient to the format used by the filters.
 */
-static void update_user_tone(struct vrc7_sound *vrc7_s) {
-	for (int i = 0; i < VRC7_NUM_CHANNELS; i++) {
-		if (vrc7_s->channels[i]->instrument != 0)
-			continue;
+static vrc7_filter_value make_coeff(double coeff) {
+#ifdef VRC7_SOUND_FIXED_POINT
+	return (vrc7_filter_value) floor(coeff * ((int64_t)1 << FILTER_COEFF_SHIFT) + 0.5);
+#else
+	return (vrc7_filter_value) coeff;
+#endif
+}
 
-		//Same as set_octave, prevent duplicate code by setting instrument to itself
-		set_instrument(vrc7_s, i, 0);
+/*
+Updates the mix matrix from stereo_volume, channel_mask and mono_mode. Disabled channels get a gain of 0. Only called when one of them changed since the last tick.
+*/
+static void update_gains(struct vrc7_sound *vrc7_s) {
+	memcpy(vrc7_s->stereo_gain_source, vrc7_s->stereo_volume, sizeof(vrc7_s->stereo_volume));
+	vrc7_s->stereo_gain_mask = vrc7_s->channel_mask;
+	vrc7_s->stereo_gain_mono_mode = vrc7_s->mono_mode;
+	vrc7_s->stereo_gain_mono = vrc7_s->mono_mode == VRC7_MONO_ON || (vrc7_s->mono_mode == VRC7_MONO_AUTO
+		&& memcmp(vrc7_s->stereo_volume[STEREO_LEFT], vrc7_s->stereo_volume[STEREO_RIGHT], sizeof(vrc7_s->stereo_volume[0])) == 0);
+	vrc7_s->unity_gain = true;
+
+	for (int side = 0; side < 2; side++) {
+		for (int i = 0; i < VRC7_MAX_CHANNELS; i++) {
+			double volume = vrc7_s->stereo_volume[side][i];
+			if (vrc7_s->stereo_gain_mono)
+				volume = (vrc7_s->stereo_volume[STEREO_LEFT][i] + vrc7_s->stereo_volume[STEREO_RIGHT][i]) / 2;
+			if (BIT_TEST(vrc7_s->channel_mask, i))
+				volume = 0.0;
+			if (volume != 1.0)
+				vrc7_s->unity_gain = false;
+#ifdef VRC7_SOUND_FIXED_POINT
+			vrc7_s->stereo_gain[side][i] = (int32_t) floor(volume * (1 << GAIN_SHIFT) + 0.5);
+#else
+			vrc7_s->stereo_gain[side][i] = volume;
+#endif
+		}
+	}
+}
+
+/*
+Resampler functions. See struct vrc7_time.
+*/
+static void time_set_step(struct vrc7_time *time, double clock_rate, double sample_rate) {
+#ifdef VRC7_SOUND_FIXED_POINT
+	uint32_t clock = (uint32_t)(clock_rate + 0.5);
+	time->unit = (uint32_t)(sample_rate + 0.5);
+	time->step = clock / time->unit;
+	time->step_frac = clock % time->unit;
+#else
+	time->step = clock_rate / sample_rate;
+#endif
+}
+
+static void time_init(struct vrc7_time *time, double clock_rate, double sample_rate) {
+	time_set_step(time, clock_rate, sample_rate);
+	time->current = 0;
+#ifdef VRC7_SOUND_FIXED_POINT
+	time->current_frac = 0;
+#endif
+}
+
+static inline void time_advance(struct vrc7_time *time) {
+	time->current += time->step;
+#ifdef VRC7_SOUND_FIXED_POINT
+	time->current_frac += time->step_frac;
+	if (time->current_frac >= time->unit) {
+		time->current_frac -= time->unit;
+		time->current++;
 	}
+#endif
 }
 
 /*
@@ -552,18 +841,19 @@ static void update_user_tone(struct vrc7_sound *vrc7_s) {
 
 VRC7SOUND_API struct vrc7_sound *vrc7_new(void) {
 	make_tables();
+	init_kernels();
 
 	struct vrc7_sound *vrc7_s = (struct vrc7_sound *) calloc(1,sizeof(struct vrc7_sound));
 
-	for (int i = 0; i < VRC7_NUM_CHANNELS; i++) {
+	for (int i = 0; i < VRC7_MAX_CHANNELS; i++) {
 		vrc7_s->channels[i] = (struct vrc7_channel *) calloc(1,sizeof(struct vrc7_channel));
 		vrc7_s->channels[i]->slots[MODULATOR] = (struct vrc7_slot *) calloc(1,sizeof(struct vrc7_slot));
 		vrc7_s->channels[i]->slots[CARRIER] = (struct vrc7_slot *) calloc(1,sizeof(struct vrc7_slot));
 	}
 
-	for (int i = 0; i < VRC7_NUM_PATCHES; i++) {
-		vrc7_s->patches[i] = (struct vrc7_patch *) calloc(1,sizeof(struct vrc7_patch));
-	}
+	//Only the user tone is owned by the vrc7_sound object, the other patches point into the selected patch bank
+	vrc7_s->patches[0] = (struct vrc7_patch *) calloc(1,sizeof(struct vrc7_patch));
+	vrc7_s->derived[0] = (struct vrc7_patch_derived *) calloc(1, sizeof(struct vrc7_patch_derived));
 
 	vrc7_s->signal[STEREO_LEFT] = calloc(VRC7_SIGNAL_CHUNK_LENGTH, sizeof(int16_t));
 	vrc7_s->signal[STEREO_RIGHT] = calloc(VRC7_SIGNAL_CHUNK_LENGTH, sizeof(int16_t));
@@ -576,11 +866,11 @@ VRC7SOUND_API void vrc7_delete(struct vrc7_sound *vrc7_s) {
 	free(vrc7_s->signal[STEREO_LEFT]);
 	free(vrc7_s->signal[STEREO_RIGHT]);
 
-	for (int i = 0; i < VRC7_NUM_PATCHES; i++) {
-		free(vrc7_s->patches[i]);
-	}
+	free(vrc7_s->patches[0]);
+	free(vrc7_s->derived[0]);
+	free(vrc7_s->events);
 
-	for (int i = 0; i < VRC7_NUM_CHANNELS; i++) {
+	for (int i = 0; i < VRC7_MAX_CHANNELS; i++) {
 		free(vrc7_s->channels[i]->slots[CARRIER]);
 		free(vrc7_s->channels[i]->slots[MODULATOR]);
 		free(vrc7_s->channels[i]);
@@ -590,7 +880,18 @@ VRC7SOUND_API void vrc7_delete(struct vrc7_sound *vrc7_s) {
 }
 
 VRC7SOUND_API void vrc7_reset(struct vrc7_sound *vrc7_s) {
-	vrc7_set_patch_set(vrc7_s, VRC7_NUKE_TONE);
+	if (vrc7_s->chip_type == VRC7_CHIP_YM2413) {
+		vrc7_s->num_channels = VRC7_MAX_CHANNELS;
+		vrc7_set_patch_set(vrc7_s, OPLL_2413_TONE);
+	}
+	else {
+		vrc7_s->num_channels = VRC7_NUM_CHANNELS;
+		vrc7_set_patch_set(vrc7_s, VRC7_NUKE_TONE);
+	}
+	vrc7_s->rhythm = false;
+	vrc7_s->rhythm_keys = 0;
+	vrc7_s->noise = 1;
+	vrc7_s->fast_forward = 1;
 	vrc7_set_clock_rate(vrc7_s, VRC7_DEFAULT_CLOCK_RATE);
 	vrc7_set_sample_rate(vrc7_s, VRC7_DEFAULT_SAMPLE_RATE);
 	vrc7_s->vibrato_counter = 0;
@@ -602,8 +903,31 @@ VRC7SOUND_API void vrc7_reset(struct vrc7_sound *vrc7_s) {
 	vrc7_s->address = 0x00;
 	vrc7_s->channel_mask = 0;
 	vrc7_s->filter = vrc7_filter_lagrange_point_fast;
+	vrc7_s->stem_filter = vrc7_stem_filter_raw;
+	vrc7_s->meters_enabled = false;
+	vrc7_s->clock_divider = VRC7_DEFAULT_CLOCK_DIVIDER;
+	vrc7_s->mono_mode = VRC7_MONO_OFF;
+	vrc7_s->mono_output = false;
+	vrc7_s->skip_idle_channels = false;
+	vrc7_s->mono = false;
+	vrc7_s->filter_mono = false;
+	vrc7_s->clock_counter = 0;
+	vrc7_s->tick_count = 0;
+	vrc7_s->events_dropped = 0;
+	vrc7_s->event_read = vrc7_s->event_write = 0;
+
+	for (int i = 0; i < 2; i++) {
+		vrc7_s->prev_input[i] = 0;
+		vrc7_s->prev_output[i] = 0;
+	}
 
-	for (int i = 0; i < VRC7_NUM_CHANNELS; i++) {
+	memset(vrc7_s->meter_peak, 0, sizeof(vrc7_s->meter_peak));
+	memset(vrc7_s->meter_sum, 0, sizeof(vrc7_s->meter_sum));
+	memset(vrc7_s->master_peak, 0, sizeof(vrc7_s->master_peak));
+	memset(vrc7_s->master_sum, 0, sizeof(vrc7_s->master_sum));
+	vrc7_s->meter_ticks = 0;
+
+	for (int i = 0; i < VRC7_MAX_CHANNELS; i++) {
 		vrc7_s->channels[i]->fNum = 0;
 		vrc7_s->channels[i]->octave = 0;
 		vrc7_s->channels[i]->volume = 0;
@@ -612,6 +936,8 @@ VRC7SOUND_API void vrc7_reset(struct vrc7_sound *vrc7_s) {
 		vrc7_s->channels[i]->trigger = false;
 		vrc7_s->stereo_volume[STEREO_LEFT][i] = 1.0;
 		vrc7_s->stereo_volume[STEREO_RIGHT][i] = 1.0;
+		vrc7_s->stems[i].prev_input = 0;
+		vrc7_s->stems[i].prev_output = 0;
 
 		for (int j = 0; j < 2; j++) {
 			int type = j == 0 ? MODULATOR : CARRIER;
@@ -623,21 +949,27 @@ VRC7SOUND_API void vrc7_reset(struct vrc7_sound *vrc7_s) {
 			vrc7_s->channels[i]->slots[type]->ksl_val = 0;
 			vrc7_s->channels[i]->slots[type]->env_rate_high = 0;
 			vrc7_s->channels[i]->slots[type]->env_rate_low = 0;
-			vrc7_s->channels[i]->slots[type]->env_stage = ENV_DAMPING;
+			vrc7_s->channels[i]->slots[type]->env_stage = VRC7_ENV_DAMPING;
 			vrc7_s->channels[i]->slots[type]->env_value = 0x7f;
 			vrc7_s->channels[i]->slots[type]->env_enabled = false;
 			vrc7_s->channels[i]->slots[type]->restart_env = false;
 		}
 	}
+	update_lfo(vrc7_s);
+	update_gains(vrc7_s);
 }
 
 VRC7SOUND_API void vrc7_clear(struct vrc7_sound *vrc7_s) {
 	unsigned char empty[8] = { 0,0,0,0,0,0,0,0 };
 	vrc7_reg_to_patch(empty, vrc7_s->patches[0]);
+	derive_patch(vrc7_s->patches[0], vrc7_s->derived[0]);
+	vrc7_s->user_tone_dirty = false;
 
 	vrc7_s->tremolo_value = 0;
 	vrc7_s->tremolo_inc = 1;
 	vrc7_s->mini_counter = 0;
+	vrc7_s->rhythm = false;
+	vrc7_s->rhythm_keys = 0;
 
 #ifdef VRC7_SOUND_TEST_REG
 	vrc7_s->test_envelope = false;
@@ -646,7 +978,7 @@ VRC7SOUND_API void vrc7_clear(struct vrc7_sound *vrc7_s) {
 	vrc7_s->test_counters = false;
 #endif
 
-	for (int i = 0; i < VRC7_NUM_CHANNELS; i++) {
+	for (uint32_t i = 0; i < vrc7_s->num_channels; i++) {
 		vrc7_s->channels[i]->fNum = 0;
 		vrc7_s->channels[i]->octave = 0;
 		vrc7_s->channels[i]->volume = 0;
@@ -654,12 +986,18 @@ VRC7SOUND_API void vrc7_clear(struct vrc7_sound *vrc7_s) {
 
 		for (int j = 0; j < 2; j++) {
 			int type = j == 0 ? MODULATOR : CARRIER;
-			vrc7_s->channels[i]->slots[type]->env_stage = ENV_DAMPING;
+			vrc7_s->channels[i]->slots[type]->env_stage = VRC7_ENV_DAMPING;
 			vrc7_s->channels[i]->slots[type]->env_value = 0;
 			vrc7_s->channels[i]->slots[type]->env_rate_high = 0;
 			vrc7_s->channels[i]->slots[type]->env_rate_low = 0;
 		}
 	}
+	update_lfo(vrc7_s);
+}
+
+VRC7SOUND_API void vrc7_set_chip_type(struct vrc7_sound *vrc7_s, int chip_type) {
+	vrc7_s->chip_type = chip_type;
+	vrc7_reset(vrc7_s);
 }
 
 VRC7SOUND_API void vrc7_set_clock_rate(struct vrc7_sound *vrc7_s, double clock_rate) {
@@ -669,46 +1007,198 @@ VRC7SOUND_API void vrc7_set_clock_rate(struct vrc7_sound *vrc7_s, double clock_r
 	double alpha2_fast = 0.0047 * 27.0 * 33.0 * 2.0 * clock_rate / 72.0; //0.0000000047*27000.0*33000.0*2.0*clock_rate/72.0;
 
 	//compute filter coefficients
-	vrc7_s->fir_coeff = (float) (33000.0/(alpha1+alpha2));
-	vrc7_s->iir_coeff = (float) (-(alpha1 - alpha2) / (alpha1 + alpha2));
-	vrc7_s->fir_coeff_fast = (float)(33000.0 / (alpha1 + alpha2_fast));
-	vrc7_s->iir_coeff_fast = (float)(-(alpha1 - alpha2_fast) / (alpha1 + alpha2_fast));
+	vrc7_s->fir_coeff = make_coeff(33000.0/(alpha1+alpha2));
+	vrc7_s->iir_coeff = make_coeff(-(alpha1 - alpha2) / (alpha1 + alpha2));
+	vrc7_s->fir_coeff_fast = make_coeff(33000.0 / (alpha1 + alpha2_fast));
+	vrc7_s->iir_coeff_fast = make_coeff(-(alpha1 - alpha2_fast) / (alpha1 + alpha2_fast));
+}
+
+/*
+Sets up the fast-forward filter for the rate at which it runs. Every sample stands for fast_forward samples of emulated time.
+*/
+static void update_fast_forward_coeffs(struct vrc7_sound *vrc7_s) {
+	double alpha1 = 27000.0 + 33000.0;
+	double alpha2 = 0.0047 * 27.0 * 33.0 * 2.0 * vrc7_s->sample_rate / vrc7_s->fast_forward;
+	vrc7_s->fir_coeff_ff = make_coeff(33000.0 / (alpha1 + alpha2));
+	vrc7_s->iir_coeff_ff = make_coeff(-(alpha1 - alpha2) / (alpha1 + alpha2));
 }
 
 VRC7SOUND_API void vrc7_set_sample_rate(struct vrc7_sound *vrc7_s, double sample_rate) {
 	vrc7_s->sample_rate = sample_rate;
-	vrc7_s->sample_length = vrc7_s->clock_rate / sample_rate;
-	vrc7_s->current_time = 0.0f;
+	time_init(&vrc7_s->time, vrc7_s->clock_rate * vrc7_s->fast_forward, sample_rate);
+	update_fast_forward_coeffs(vrc7_s);
 }
 
-VRC7SOUND_API void vrc7_set_patch_set(struct vrc7_sound *vrc7_s, int set) {
-	for (int i = 0; i < VRC7_NUM_PATCHES; i++) {
-		vrc7_get_default_patch(set, i, vrc7_s->patches[i]);
+VRC7SOUND_API void vrc7_set_fast_forward(struct vrc7_sound *vrc7_s, uint32_t factor) {
+	factor = min(max(factor, 1), VRC7_MAX_FAST_FORWARD);
+	if (factor == vrc7_s->fast_forward)
+		return;
+
+	if (vrc7_s->fast_forward == 1) {
+		//Start the decimator and its filter from silence
+		for (int side = 0; side < 2; side++) {
+			vrc7_s->ff_prev_input[side] = 0;
+			vrc7_s->ff_prev_output[side] = 0;
+			vrc7_s->ff_sum[side] = 0;
+			vrc7_s->ff_input[side] = 0;
+			vrc7_s->ff_output[side] = 0;
+		}
+		vrc7_s->ff_ticks = 0;
+		vrc7_s->ff_rendered = false;
+	}
+	else if (factor == 1 && vrc7_s->ff_rendered) {
+		//The current chunk was not filtered
+		current_kernels()->fill(vrc7_s->signal[STEREO_LEFT], vrc7_s->ff_output[STEREO_LEFT]);
+		current_kernels()->fill(vrc7_s->signal[STEREO_RIGHT], vrc7_s->ff_output[STEREO_RIGHT]);
 	}
+
+	//Keep the position in the current chunk
+	vrc7_s->fast_forward = factor;
+	time_set_step(&vrc7_s->time, vrc7_s->clock_rate * factor, vrc7_s->sample_rate);
+	update_fast_forward_coeffs(vrc7_s);
+}
+
+VRC7SOUND_API void vrc7_set_patch_set(struct vrc7_sound *vrc7_s, int set) {
+	vrc7_set_patch_bank(vrc7_s, &default_banks[set]);
 	vrc7_s->patch_set = set;
 }
 
-VRC7SOUND_API void vrc7_tick(struct vrc7_sound *vrc7_s) {
-	//Update channels
-	for (int i = 0; i < 18; i++) {
-		//Clear previous signal
-		vrc7_s->signal[STEREO_LEFT][i * 4 + 0] = vrc7_s->signal[STEREO_RIGHT][i * 4 + 0] = 0;
-		vrc7_s->signal[STEREO_LEFT][i * 4 + 1] = vrc7_s->signal[STEREO_RIGHT][i * 4 + 1] = 0;
-		vrc7_s->signal[STEREO_LEFT][i * 4 + 2] = vrc7_s->signal[STEREO_RIGHT][i * 4 + 2] = 0;
-		vrc7_s->signal[STEREO_LEFT][i * 4 + 3] = vrc7_s->signal[STEREO_RIGHT][i * 4 + 3] = 0;
-
-		//vrc7 technically has 9 channels, but only 6 of them can be used.
-		if (CHANNEL_SCHEDULE[i] < VRC7_NUM_CHANNELS) {
-			int channel_num = CHANNEL_SCHEDULE[i];
-			int32_t val = update_slot(vrc7_s, channel_num, TYPE_SCHEDULE[i]);
+VRC7SOUND_API void vrc7_set_patch_bank(struct vrc7_sound *vrc7_s, const struct vrc7_patch_bank *bank) {
+	//The user tone can be changed by register writes, so it gets copied
+	*vrc7_s->patches[0] = bank->patches[0];
+	*vrc7_s->derived[0] = bank->derived[0];
+	vrc7_s->user_tone_dirty = false;
 
-			//only add output to the signal the slot is a carrier and the channel is enabled
-			if (!BIT_TEST(vrc7_s->channel_mask, channel_num) && TYPE_SCHEDULE[i] == CARRIER) {
-				vrc7_s->signal[STEREO_LEFT][i * 4] = (int16_t) ((val >> 3) * vrc7_s->stereo_volume[STEREO_LEFT][channel_num]);
-				vrc7_s->signal[STEREO_RIGHT][i * 4] = (int16_t) ((val >> 3) * vrc7_s->stereo_volume[STEREO_RIGHT][channel_num]);
-			}
-		}
-#ifdef VRC7_SOUND_TEST_REG
+	//The remaining patches are never written to, so they can be used from the bank directly
+	for (int i = 1; i < VRC7_NUM_PATCHES + VRC7_NUM_RHYTHM_PATCHES; i++) {
+		vrc7_s->patches[i] = (struct vrc7_patch *) &bank->patches[i];
+		vrc7_s->derived[i] = (struct vrc7_patch_derived *) &bank->derived[i];
+	}
+	vrc7_s->patch_bank = bank;
+	vrc7_s->patch_set = -1;
+
+	//Update precalculated values of the channels
+	for (uint32_t i = 0; i < vrc7_s->num_channels; i++) {
+		set_instrument(vrc7_s, i, vrc7_s->channels[i]->instrument);
+	}
+}
+
+/*
+Adds the outputs of one tick to the level meters.
+*/
+static void update_meters(struct vrc7_sound *vrc7_s, const int32_t *outputs) {
+	//Sum the outputs of each channel. Channels 7 and 8 output twice per tick in rhythm mode.
+	int32_t levels[VRC7_MAX_CHANNELS] = { 0 };
+	for (int i = 0; i < 18; i++) {
+		levels[CHANNEL_SCHEDULE[i]] += outputs[i];
+	}
+
+	for (uint32_t i = 0; i < vrc7_s->num_channels; i++) {
+		uint32_t level = (uint32_t)abs(levels[i]);
+		vrc7_s->meter_peak[i] = max(vrc7_s->meter_peak[i], level);
+		vrc7_s->meter_sum[i] += (uint64_t)level * level;
+	}
+
+	for (int side = 0; side < 2; side++) {
+		const int16_t *signal = vrc7_s->signal[vrc7_s->mono ? STEREO_LEFT : side];
+		int32_t sum = 0;
+		for (int i = 0; i < 18; i++) {
+			sum += signal[i * 4];
+		}
+		uint32_t level = (uint32_t)abs(sum);
+		vrc7_s->master_peak[side] = max(vrc7_s->master_peak[side], level);
+		vrc7_s->master_sum[side] += (uint64_t)level * level;
+	}
+
+	vrc7_s->meter_ticks++;
+}
+
+/*
+Returns a bit field of the channels that render_chunk can skip: both slots are keyed off and their envelopes have stopped at the
+end of the release. The rhythm channels are never skipped, since they share their phase generators. Skipped slots output 0,
+but their phase is still advanced.
+*/
+static uint32_t find_idle_channels(struct vrc7_sound *vrc7_s) {
+	uint32_t idle = 0;
+	uint32_t count = vrc7_s->rhythm ? min(vrc7_s->num_channels, RHYTHM_FIRST_CHANNEL) : vrc7_s->num_channels;
+	for (uint32_t ch = 0; ch < count; ch++) {
+		bool channel_idle = true;
+		for (int type = 0; type < 2; type++) {
+			struct vrc7_slot *slot = vrc7_s->channels[ch]->slots[type];
+			if (slot->env_enabled || slot->restart_env || slot->env_value < 0x7c || get_slot_key(vrc7_s, ch, type))
+				channel_idle = false;
+		}
+		if (!channel_idle)
+			continue;
+
+		//The phase keeps running, so the next note starts at the same phase as without skipping. The feedback history is cleared
+		//although the operators still output small values at this attenuation, so the first samples of the next note can differ slightly.
+		for (int type = 0; type < 2; type++) {
+			struct vrc7_slot *slot = vrc7_s->channels[ch]->slots[type];
+			slot->sample = 0;
+			slot->sample_prev = 0;
+			slot->phase += slot->phase_step;
+		}
+		idle |= 1u << ch;
+	}
+	return idle;
+}
+
+/*
+Runs the emulation for one tick and leaves the unfiltered output in the signal. Stems are complete after this function.
+*/
+static void render_chunk(struct vrc7_sound *vrc7_s) {
+	//Apply pending register writes
+	if (vrc7_s->user_tone_dirty || vrc7_s->dirty_channels)
+		update_dirty(vrc7_s);
+
+	//Update the mix matrix when stereo_volume, channel_mask or mono_mode was changed
+	if (vrc7_s->stereo_gain_mask != vrc7_s->channel_mask || vrc7_s->stereo_gain_mono_mode != vrc7_s->mono_mode
+			|| memcmp(vrc7_s->stereo_gain_source, vrc7_s->stereo_volume, sizeof(vrc7_s->stereo_volume)) != 0)
+		update_gains(vrc7_s);
+
+	//Automatic mono waits until the filter states of both sides are the same, so switching from stereo does not cut off the tail of the right side
+	bool filter_converged = vrc7_s->prev_input[STEREO_LEFT] == vrc7_s->prev_input[STEREO_RIGHT]
+		&& vrc7_s->prev_output[STEREO_LEFT] == vrc7_s->prev_output[STEREO_RIGHT];
+	vrc7_s->mono = vrc7_s->stereo_gain_mono && (vrc7_s->mono || vrc7_s->mono_mode != VRC7_MONO_AUTO || filter_converged);
+	bool mono = vrc7_s->mono;
+
+	//Clear enabled stems
+	for (uint32_t i = 0; i < vrc7_s->num_channels; i++) {
+		if (vrc7_s->stems[i].signal)
+			current_kernels()->clear(vrc7_s->stems[i].signal);
+	}
+
+	//Output of every slot, mixed after all slots are updated
+	int32_t outputs[18];
+	uint32_t idle_channels = vrc7_s->skip_idle_channels ? find_idle_channels(vrc7_s) : 0;
+
+	//Update channels
+	for (int i = 0; i < 18; i++) {
+		outputs[i] = 0;
+
+		//vrc7 technically has 9 channels, but only 6 of them can be used. The YM2413 uses all of them.
+		if (CHANNEL_SCHEDULE[i] < vrc7_s->num_channels && !BIT_TEST(idle_channels, CHANNEL_SCHEDULE[i])) {
+			int channel_num = CHANNEL_SCHEDULE[i];
+			int32_t val = update_slot(vrc7_s, channel_num, TYPE_SCHEDULE[i]);
+
+			//Carriers produce output. In rhythm mode, the modulators of HH and TOM do as well.
+			bool rhythm = vrc7_s->rhythm && channel_num >= RHYTHM_FIRST_CHANNEL;
+			if (TYPE_SCHEDULE[i] == CARRIER || (rhythm && channel_num > RHYTHM_FIRST_CHANNEL)) {
+				int32_t out = val >> 3;
+
+				//Rhythm instruments are output at twice the volume
+				if (rhythm)
+					out *= 2;
+
+				//Stems receive the output regardless of channel_mask and stereo_volume
+				if (vrc7_s->stems[channel_num].signal)
+					vrc7_s->stems[channel_num].signal[i * 4] = (int16_t) out;
+
+				outputs[i] = out;
+			}
+		}
+#ifdef VRC7_SOUND_TEST_REG
 		if (!vrc7_s->test_counters) {
 #endif
 		  //update envelope counters and lfos
@@ -722,7 +1212,7 @@ VRC7SOUND_API void vrc7_tick(struct vrc7_sound *vrc7_s) {
 		}
 
 		if (vrc7_s->test_halt_phase) {
-			if (CHANNEL_SCHEDULE[i] < VRC7_NUM_CHANNELS) {
+			if (CHANNEL_SCHEDULE[i] < vrc7_s->num_channels) {
 				int channel = CHANNEL_SCHEDULE[i];
 				int type = TYPE_SCHEDULE[i];
 				vrc7_s->channels[channel]->slots[type]->phase = 0;
@@ -731,20 +1221,481 @@ VRC7SOUND_API void vrc7_tick(struct vrc7_sound *vrc7_s) {
 #endif
 	}
 
+	//Mix the slot outputs. Every channel outputs once per tick (twice for HH/SD and TOM/CYM), so this applies each gain once per channel.
+	//Each slot fills every 4th sample of the signal, the samples in between are 0. In mono, only the left side is mixed.
+	for (int side = 0; side < (mono ? 1 : 2); side++) {
+		int16_t mixed[18];
+		if (vrc7_s->unity_gain) {
+			for (int i = 0; i < 18; i++) {
+				mixed[i] = (int16_t) outputs[i];
+			}
+		}
+		else {
+			for (int i = 0; i < 18; i++) {
+				uint32_t channel_num = CHANNEL_SCHEDULE[i];
+#ifdef VRC7_SOUND_FIXED_POINT
+				//Division instead of a shift rounds towards zero like the floating-point version
+				mixed[i] = (int16_t) (outputs[i] * vrc7_s->stereo_gain[side][channel_num] / (1 << GAIN_SHIFT));
+#else
+				mixed[i] = (int16_t) (outputs[i] * vrc7_s->stereo_gain[side][channel_num]);
+#endif
+			}
+		}
+		current_kernels()->spread(vrc7_s->signal[side], mixed);
+	}
+
+	if (vrc7_s->meters_enabled)
+		update_meters(vrc7_s, outputs);
+
+	//Update rhythm noise generator
+	if (vrc7_s->chip_type == VRC7_CHIP_YM2413) {
+		uint32_t noise_bit = ((vrc7_s->noise >> 14) ^ vrc7_s->noise) & 1;
+		vrc7_s->noise = (vrc7_s->noise >> 1) | (noise_bit << 22);
+	}
+
+	//Apply stem filters
+	for (uint32_t i = 0; i < vrc7_s->num_channels; i++) {
+		if (vrc7_s->stems[i].signal)
+			vrc7_s->stem_filter(vrc7_s, &vrc7_s->stems[i]);
+	}
+
+	vrc7_s->tick_count++;
+}
+
+/*
+Called before the output filter. When the signal goes back from mono to stereo, the right side continues with the filter state of the
+left side, which is what it would have had.
+*/
+static void update_filter_mode(struct vrc7_sound *vrc7_s) {
+	if (vrc7_s->filter_mono && !vrc7_s->mono) {
+		vrc7_s->prev_input[STEREO_RIGHT] = vrc7_s->prev_input[STEREO_LEFT];
+		vrc7_s->prev_output[STEREO_RIGHT] = vrc7_s->prev_output[STEREO_LEFT];
+	}
+	vrc7_s->filter_mono = vrc7_s->mono;
+}
+
+VRC7SOUND_API void vrc7_tick(struct vrc7_sound *vrc7_s) {
+	render_chunk(vrc7_s);
+
 	//Apply output filter
+	update_filter_mode(vrc7_s);
 	vrc7_s->filter(vrc7_s);
 }
 
-VRC7SOUND_API void vrc7_fetch_sample(struct vrc7_sound *vrc7_s, int16_t *sample) {
-	while (vrc7_s->current_time >= VRC7_SIGNAL_CHUNK_LENGTH) {
+VRC7SOUND_API void vrc7_read_meters(struct vrc7_sound *vrc7_s, struct vrc7_meters *meters) {
+	uint32_t ticks = max(vrc7_s->meter_ticks, 1);
+
+	memset(meters, 0, sizeof(struct vrc7_meters));
+	for (uint32_t i = 0; i < vrc7_s->num_channels; i++) {
+		meters->channels[i].peak = vrc7_s->meter_peak[i];
+		meters->channels[i].rms = sqrt((double)vrc7_s->meter_sum[i] / ticks);
+	}
+	for (int side = 0; side < 2; side++) {
+		meters->master[side].peak = vrc7_s->master_peak[side];
+		meters->master[side].rms = sqrt((double)vrc7_s->master_sum[side] / ticks);
+	}
+	meters->ticks = vrc7_s->meter_ticks;
+
+	//Start a new window
+	memset(vrc7_s->meter_peak, 0, sizeof(vrc7_s->meter_peak));
+	memset(vrc7_s->meter_sum, 0, sizeof(vrc7_s->meter_sum));
+	memset(vrc7_s->master_peak, 0, sizeof(vrc7_s->master_peak));
+	memset(vrc7_s->master_sum, 0, sizeof(vrc7_s->master_sum));
+	vrc7_s->meter_ticks = 0;
+}
+
+/*
+Fast-forward tick: emulates without filtering and adds the chunk to the decimator.
+*/
+static void fast_forward_tick(struct vrc7_sound *vrc7_s) {
+	render_chunk(vrc7_s);
+
+	vrc7_s->ff_sum[STEREO_LEFT] += current_kernels()->sum(vrc7_s->signal[STEREO_LEFT]);
+	vrc7_s->ff_sum[STEREO_RIGHT] += current_kernels()->sum(vrc7_s->signal[vrc7_s->mono ? STEREO_LEFT : STEREO_RIGHT]);
+	vrc7_s->ff_ticks++;
+	vrc7_s->ff_rendered = true;
+}
+
+/*
+Produces one fast-forward sample from the average of the chunks since the last one. If no tick happened in between, the last average is used again.
+*/
+static void fast_forward_sample(struct vrc7_sound *vrc7_s, int16_t *sample) {
+	if (vrc7_s->ff_ticks) {
+		for (int side = 0; side < 2; side++) {
+			vrc7_s->ff_input[side] = (int16_t)(vrc7_s->ff_sum[side] / (int32_t)vrc7_s->ff_ticks);
+			vrc7_s->ff_sum[side] = 0;
+		}
+		vrc7_s->ff_ticks = 0;
+	}
+
+	for (int side = 0; side < (vrc7_s->mono ? 1 : 2); side++) {
+		vrc7_s->ff_output[side] = filter_lagrange_point_step(vrc7_s->ff_input[side], vrc7_s->fir_coeff_ff, vrc7_s->iir_coeff_ff,
+			&vrc7_s->ff_prev_input[side], &vrc7_s->ff_prev_output[side]);
+	}
+	if (vrc7_s->mono) {
+		vrc7_s->ff_output[STEREO_RIGHT] = vrc7_s->ff_output[STEREO_LEFT];
+		vrc7_s->ff_prev_input[STEREO_RIGHT] = vrc7_s->ff_prev_input[STEREO_LEFT];
+		vrc7_s->ff_prev_output[STEREO_RIGHT] = vrc7_s->ff_prev_output[STEREO_LEFT];
+	}
+
+	sample[0] = vrc7_s->ff_output[STEREO_LEFT];
+	sample[1] = vrc7_s->ff_output[STEREO_RIGHT];
+}
+
+/*
+Runs one tick of the sample functions.
+*/
+static inline void advance_tick(struct vrc7_sound *vrc7_s) {
+	if (vrc7_s->fast_forward > 1)
+		fast_forward_tick(vrc7_s);
+	else
 		vrc7_tick(vrc7_s);
-		vrc7_s->current_time -= VRC7_SIGNAL_CHUNK_LENGTH;
+}
+
+VRC7SOUND_API void vrc7_fetch_sample(struct vrc7_sound *vrc7_s, int16_t *sample) {
+	vrc7_fetch_sample_stems(vrc7_s, sample, NULL);
+}
+
+VRC7SOUND_API void vrc7_fetch_sample_stems(struct vrc7_sound *vrc7_s, int16_t *sample, int16_t *stem_samples) {
+	while (vrc7_s->time.current >= VRC7_SIGNAL_CHUNK_LENGTH) {
+		advance_tick(vrc7_s);
+		vrc7_s->time.current -= VRC7_SIGNAL_CHUNK_LENGTH;
 	}
 
 	//Use nearest-neighbour resampling. Since we can choose from 72 samples, this ough to be enough.
-	sample[0] = vrc7_s->signal[STEREO_LEFT][(int) vrc7_s->current_time];
-	sample[1] = vrc7_s->signal[STEREO_RIGHT][(int)vrc7_s->current_time];
-	vrc7_s->current_time += vrc7_s->sample_length;
+	int index = (int)vrc7_s->time.current;
+	if (vrc7_s->fast_forward > 1) {
+		fast_forward_sample(vrc7_s, sample);
+	}
+	else {
+		sample[0] = vrc7_s->signal[STEREO_LEFT][index];
+		sample[1] = vrc7_s->signal[vrc7_s->mono ? STEREO_LEFT : STEREO_RIGHT][index];
+	}
+
+	//Stems share the time base of the mix, so they can be sampled at the same position
+	if (stem_samples) {
+		for (uint32_t i = 0; i < vrc7_s->num_channels; i++) {
+			stem_samples[i] = vrc7_s->stems[i].signal ? vrc7_s->stems[i].signal[index] : 0;
+		}
+	}
+	time_advance(&vrc7_s->time);
+}
+
+/*
+Writes the samples that fall into the current chunk into out. Samples beyond max_frames are dropped.
+*/
+static uint32_t emit_frames(struct vrc7_sound *vrc7_s, int16_t *out, uint32_t max_frames) {
+	uint32_t frames = 0;
+	if (!out)
+		max_frames = 0;
+
+	const int16_t *left = vrc7_s->signal[STEREO_LEFT];
+	const int16_t *right = vrc7_s->signal[vrc7_s->mono ? STEREO_LEFT : STEREO_RIGHT];
+	while (vrc7_s->time.current < VRC7_SIGNAL_CHUNK_LENGTH) {
+		//Fast-forward samples are produced even if they are dropped, so the decimator keeps its rate
+		int16_t sample[2];
+		if (vrc7_s->fast_forward > 1) {
+			fast_forward_sample(vrc7_s, sample);
+		}
+		else if (frames < max_frames) {
+			int index = (int)vrc7_s->time.current;
+			sample[0] = left[index];
+			sample[1] = right[index];
+		}
+
+		if (frames < max_frames) {
+			if (vrc7_s->mono_output) {
+				out[frames] = sample[0];
+			}
+			else {
+				out[frames * 2] = sample[0];
+				out[frames * 2 + 1] = sample[1];
+			}
+			frames++;
+		}
+		time_advance(&vrc7_s->time);
+	}
+	return frames;
+}
+
+VRC7SOUND_API uint32_t vrc7_run_clocks(struct vrc7_sound *vrc7_s, uint32_t cpu_clocks, int16_t *out, uint32_t max_frames) {
+	uint32_t frames = 0;
+
+	vrc7_s->clock_counter += cpu_clocks;
+	for (;;) {
+		frames += emit_frames(vrc7_s, out ? out + frames * (vrc7_s->mono_output ? 1 : 2) : NULL, max_frames - frames);
+
+		if (vrc7_s->clock_counter < vrc7_s->clock_divider)
+			break;
+		vrc7_s->clock_counter -= vrc7_s->clock_divider;
+		advance_tick(vrc7_s);
+		vrc7_s->time.current -= VRC7_SIGNAL_CHUNK_LENGTH;
+	}
+	return frames;
+}
+
+VRC7SOUND_API uint32_t vrc7_resample_signal(struct vrc7_sound *vrc7_s, int16_t *out, uint32_t max_frames) {
+	uint32_t frames = emit_frames(vrc7_s, out, max_frames);
+	vrc7_s->time.current -= VRC7_SIGNAL_CHUNK_LENGTH;
+	return frames;
+}
+
+/*
+==================================================
+               VRC7 MULTI-CHIP
+==================================================
+*/
+
+VRC7SOUND_API struct vrc7_multi *vrc7_multi_new(uint32_t num_chips) {
+	if (num_chips == 0 || num_chips > VRC7_MAX_CHIPS)
+		return NULL;
+
+	struct vrc7_multi *multi = (struct vrc7_multi *) calloc(1, sizeof(struct vrc7_multi));
+	multi->num_chips = num_chips;
+	for (uint32_t i = 0; i < num_chips; i++) {
+		multi->chips[i] = vrc7_new();
+	}
+
+	//The first chip doubles as the mixing bus
+	multi->signal[STEREO_LEFT] = multi->chips[0]->signal[STEREO_LEFT];
+	multi->signal[STEREO_RIGHT] = multi->chips[0]->signal[STEREO_RIGHT];
+	multi->filter = vrc7_filter_lagrange_point_fast;
+
+	vrc7_multi_set_sample_rate(multi, VRC7_DEFAULT_SAMPLE_RATE);
+	return multi;
+}
+
+VRC7SOUND_API void vrc7_multi_delete(struct vrc7_multi *multi) {
+	for (uint32_t i = 0; i < multi->num_chips; i++) {
+		vrc7_delete(multi->chips[i]);
+	}
+	free(multi);
+}
+
+VRC7SOUND_API void vrc7_multi_set_clock_rate(struct vrc7_multi *multi, double clock_rate) {
+	for (uint32_t i = 0; i < multi->num_chips; i++) {
+		vrc7_set_clock_rate(multi->chips[i], clock_rate);
+	}
+	vrc7_multi_set_sample_rate(multi, multi->sample_rate);
+}
+
+VRC7SOUND_API void vrc7_multi_set_sample_rate(struct vrc7_multi *multi, double sample_rate) {
+	multi->sample_rate = sample_rate;
+	time_init(&multi->time, multi->chips[0]->clock_rate, sample_rate);
+}
+
+VRC7SOUND_API void vrc7_multi_tick(struct vrc7_multi *multi) {
+	//Only the chips get emulated separately
+	for (uint32_t i = 0; i < multi->num_chips; i++) {
+		render_chunk(multi->chips[i]);
+	}
+
+	//The mix is mono only if every chip is
+	bool mono = true;
+	for (uint32_t i = 0; i < multi->num_chips; i++) {
+		mono = mono && multi->chips[i]->mono;
+	}
+	int16_t *left = multi->signal[STEREO_LEFT];
+	int16_t *right = multi->signal[STEREO_RIGHT];
+	if (multi->chips[0]->mono && !mono)
+		memcpy(right, left, VRC7_SIGNAL_CHUNK_LENGTH * sizeof(int16_t));
+	multi->chips[0]->mono = mono;
+
+	//Sum unfiltered outputs into the first chip
+	for (uint32_t i = 1; i < multi->num_chips; i++) {
+		current_kernels()->add(left, multi->chips[i]->signal[STEREO_LEFT]);
+		if (!mono)
+			current_kernels()->add(right, multi->chips[i]->signal[multi->chips[i]->mono ? STEREO_LEFT : STEREO_RIGHT]);
+	}
+
+	//Filter the mix once, using the filter state of the first chip
+	update_filter_mode(multi->chips[0]);
+	multi->filter(multi->chips[0]);
+}
+
+VRC7SOUND_API void vrc7_multi_fetch_sample(struct vrc7_multi *multi, int16_t *sample) {
+	while (multi->time.current >= VRC7_SIGNAL_CHUNK_LENGTH) {
+		vrc7_multi_tick(multi);
+		multi->time.current -= VRC7_SIGNAL_CHUNK_LENGTH;
+	}
+
+	int index = (int)multi->time.current;
+	sample[0] = multi->signal[STEREO_LEFT][index];
+	sample[1] = multi->signal[multi->chips[0]->mono ? STEREO_LEFT : STEREO_RIGHT][index];
+	time_advance(&multi->time);
+}
+
+/*
+==================================================
+               VRC7 PACKED STATE
+==================================================
+*/
+
+//Make sure the packed state keeps its documented size
+typedef char packed_state_size_check[sizeof(struct vrc7_packed_state) == 192 ? 1 : -1];
+typedef char snapshot_size_check[sizeof(struct vrc7_snapshot) == 576 ? 1 : -1];
+
+static uint64_t pack_slot(const struct vrc7_slot *slot) {
+	return (uint64_t)(slot->phase & 0x7ffff)
+		| (uint64_t)(slot->env_value & 0x7f) << 19
+		| (uint64_t)(slot->env_stage & 0x3) << 26
+		| (uint64_t)slot->env_enabled << 28
+		| (uint64_t)slot->restart_env << 29
+		| (uint64_t)(slot->sample & 0xfff) << 32
+		| (uint64_t)(slot->sample_prev & 0xfff) << 44;
+}
+
+static int32_t unpack_sample(uint64_t bits) {
+	//Sign extend the 12-bit operator output
+	return (int32_t)((bits & 0xfff) ^ 0x800) - 0x800;
+}
+
+static void unpack_slot(uint64_t word, struct vrc7_slot *slot) {
+	slot->phase = word & 0x7ffff;
+	slot->env_value = (word >> 19) & 0x7f;
+	slot->env_stage = (word >> 26) & 0x3;
+	slot->env_enabled = ((word >> 28) & 1) != 0;
+	slot->restart_env = ((word >> 29) & 1) != 0;
+	slot->sample = unpack_sample(word >> 32);
+	slot->sample_prev = unpack_sample(word >> 44);
+}
+
+static void pack_channel(const struct vrc7_channel *channel, struct vrc7_packed_channel *packed) {
+	packed->modulator = pack_slot(channel->slots[MODULATOR]);
+	packed->carrier = (uint32_t)pack_slot(channel->slots[CARRIER]);
+	packed->regs = (channel->fNum & 0x1ff)
+		| (channel->octave & 0x7) << 9
+		| (channel->volume & 0xf) << 12
+		| (channel->instrument & 0xf) << 16
+		| (uint32_t)channel->sustain << 20
+		| (uint32_t)channel->trigger << 21;
+}
+
+static void unpack_channel(const struct vrc7_packed_channel *packed, struct vrc7_channel *channel) {
+	unpack_slot(packed->modulator, channel->slots[MODULATOR]);
+	unpack_slot(packed->carrier, channel->slots[CARRIER]);
+	channel->fNum = packed->regs & 0x1ff;
+	channel->octave = (packed->regs >> 9) & 0x7;
+	channel->volume = (packed->regs >> 12) & 0xf;
+	channel->instrument = (packed->regs >> 16) & 0xf;
+	channel->sustain = ((packed->regs >> 20) & 1) != 0;
+	channel->trigger = ((packed->regs >> 21) & 1) != 0;
+}
+
+VRC7SOUND_API void vrc7_pack_state(const struct vrc7_sound *vrc7_s, struct vrc7_packed_state *state) {
+	memset(state, 0, sizeof(struct vrc7_packed_state));
+
+	for (int i = 0; i < VRC7_MAX_CHANNELS; i++) {
+		if (i < VRC7_NUM_CHANNELS)
+			pack_channel(vrc7_s->channels[i], &state->channels[i]);
+		else
+			pack_channel(vrc7_s->channels[i], &state->ym2413_channels[i - VRC7_NUM_CHANNELS]);
+	}
+
+	vrc7_patch_to_reg(vrc7_s->patches[0], state->user_patch);
+	state->noise = vrc7_s->noise;
+	state->vibrato_counter = (uint16_t)vrc7_s->vibrato_counter;
+	state->envelope_counter = (uint16_t)vrc7_s->envelope_counter;
+	state->tremolo_value = (uint8_t)vrc7_s->tremolo_value;
+	state->counters = (uint8_t)((vrc7_s->mini_counter & 0x3) | (vrc7_s->zero_count & 0xf) << 2 | (vrc7_s->tremolo_inc < 0 ? 0x40 : 0));
+	state->address = (uint8_t)vrc7_s->address;
+	state->rhythm = (uint8_t)((vrc7_s->rhythm_keys & 0x1f) | (vrc7_s->rhythm ? 0x20 : 0));
+	state->test = (uint8_t)((vrc7_s->test_envelope ? 0x1 : 0) | (vrc7_s->test_reset_fmam ? 0x2 : 0)
+		| (vrc7_s->test_halt_phase ? 0x4 : 0) | (vrc7_s->test_counters ? 0x8 : 0));
+}
+
+VRC7SOUND_API void vrc7_unpack_state(struct vrc7_sound *vrc7_s, const struct vrc7_packed_state *state) {
+	for (int i = 0; i < VRC7_MAX_CHANNELS; i++) {
+		if (i < VRC7_NUM_CHANNELS)
+			unpack_channel(&state->channels[i], vrc7_s->channels[i]);
+		else
+			unpack_channel(&state->ym2413_channels[i - VRC7_NUM_CHANNELS], vrc7_s->channels[i]);
+	}
+
+	vrc7_reg_to_patch(state->user_patch, vrc7_s->patches[0]);
+	vrc7_s->noise = state->noise;
+	vrc7_s->vibrato_counter = state->vibrato_counter;
+	vrc7_s->envelope_counter = state->envelope_counter;
+	vrc7_s->tremolo_value = state->tremolo_value;
+	vrc7_s->mini_counter = state->counters & 0x3;
+	vrc7_s->zero_count = (state->counters >> 2) & 0xf;
+	vrc7_s->tremolo_inc = BIT_TEST(state->counters, 6) ? -1 : 1;
+	vrc7_s->address = state->address;
+	vrc7_s->rhythm_keys = state->rhythm & 0x1f;
+	vrc7_s->rhythm = BIT_TEST(state->rhythm, 5);
+	vrc7_s->test_envelope = BIT_TEST(state->test, 0);
+	vrc7_s->test_reset_fmam = BIT_TEST(state->test, 1);
+	vrc7_s->test_halt_phase = BIT_TEST(state->test, 2);
+	vrc7_s->test_counters = BIT_TEST(state->test, 3);
+
+	//Recalculate everything that is derived from the registers
+	vrc7_s->user_tone_dirty = true;
+	vrc7_s->dirty_channels = (1 << VRC7_MAX_CHANNELS) - 1;
+	vrc7_s->lfo_step = get_lfo_step(vrc7_s);
+}
+
+VRC7SOUND_API void vrc7_save_state(const struct vrc7_sound *vrc7_s, struct vrc7_snapshot *snapshot) {
+	memset(snapshot, 0, sizeof(struct vrc7_snapshot));
+	vrc7_pack_state(vrc7_s, &snapshot->chip);
+
+	//The chunk is only stored while samples of it are still due. Otherwise the next sample ticks first and it is never read.
+	//A mono signal is stored as two identical sides, so the snapshot can be loaded in either mode.
+	bool chunk_pending = vrc7_s->time.current < VRC7_SIGNAL_CHUNK_LENGTH;
+	for (int side = 0; side < 2; side++) {
+		int source = vrc7_s->mono ? STEREO_LEFT : side;
+		snapshot->prev_input[side] = (double)vrc7_s->prev_input[source];
+#ifdef VRC7_SOUND_FIXED_POINT
+		//Stored in the unit of the floating point build, so snapshots can be loaded by either build
+		snapshot->prev_output[side] = (double)vrc7_s->prev_output[source] / (1 << FILTER_OUTPUT_SHIFT);
+#else
+		snapshot->prev_output[side] = (double)vrc7_s->prev_output[source];
+#endif
+		if (chunk_pending)
+			memcpy(snapshot->signal[side], vrc7_s->signal[source], VRC7_SIGNAL_CHUNK_LENGTH * sizeof(int16_t));
+	}
+#ifdef VRC7_SOUND_FIXED_POINT
+	snapshot->time = vrc7_s->time.current + (double)vrc7_s->time.current_frac / vrc7_s->time.unit;
+#else
+	snapshot->time = vrc7_s->time.current;
+#endif
+	snapshot->tick_count = vrc7_s->tick_count;
+	snapshot->clock_counter = vrc7_s->clock_counter;
+}
+
+VRC7SOUND_API void vrc7_load_state(struct vrc7_sound *vrc7_s, const struct vrc7_snapshot *snapshot) {
+	vrc7_unpack_state(vrc7_s, &snapshot->chip);
+
+	for (int side = 0; side < 2; side++) {
+		vrc7_s->prev_input[side] = (vrc7_filter_value)snapshot->prev_input[side];
+#ifdef VRC7_SOUND_FIXED_POINT
+		vrc7_s->prev_output[side] = (vrc7_filter_value)floor(snapshot->prev_output[side] * (1 << FILTER_OUTPUT_SHIFT) + 0.5);
+#else
+		vrc7_s->prev_output[side] = (vrc7_filter_value)snapshot->prev_output[side];
+#endif
+		memcpy(vrc7_s->signal[side], snapshot->signal[side], VRC7_SIGNAL_CHUNK_LENGTH * sizeof(int16_t));
+	}
+#ifdef VRC7_SOUND_FIXED_POINT
+	vrc7_s->time.current = (uint32_t)snapshot->time;
+	vrc7_s->time.current_frac = (uint32_t)((snapshot->time - vrc7_s->time.current) * vrc7_s->time.unit + 0.5);
+	if (vrc7_s->time.current_frac >= vrc7_s->time.unit)
+		vrc7_s->time.current_frac = vrc7_s->time.unit - 1;
+#else
+	vrc7_s->time.current = snapshot->time;
+#endif
+	vrc7_s->tick_count = snapshot->tick_count;
+	vrc7_s->clock_counter = snapshot->clock_counter;
+}
+
+VRC7SOUND_API struct vrc7_packed_state *vrc7_packed_state_array_new(size_t count) {
+	size_t size = count * sizeof(struct vrc7_packed_state);
+	struct vrc7_packed_state *states = (struct vrc7_packed_state *) vrc7_aligned_alloc(size);
+	if (states)
+		memset(states, 0, size);
+	return states;
+}
+
+VRC7SOUND_API void vrc7_packed_state_array_delete(struct vrc7_packed_state *states) {
+	vrc7_aligned_free(states);
 }
 
 /*
@@ -757,6 +1708,53 @@ VRC7SOUND_API void vrc7_write_addr(struct vrc7_sound *vrc7_s, uint32_t addr) {
 	vrc7_s->address = addr;
 }
 
+static void push_event(struct vrc7_sound *vrc7_s, uint8_t type, uint8_t channel, uint16_t value) {
+	if (vrc7_s->event_write - vrc7_s->event_read > vrc7_s->event_mask) {
+		vrc7_s->events_dropped++;
+		return;
+	}
+
+	struct vrc7_event *event = &vrc7_s->events[vrc7_s->event_write & vrc7_s->event_mask];
+	event->tick = vrc7_s->tick_count;
+	event->type = type;
+	event->channel = channel;
+	event->value = value;
+	vrc7_s->event_write++;
+}
+
+static inline uint16_t get_pitch(struct vrc7_channel *channel) {
+	return (uint16_t)(channel->fNum | channel->octave << 9);
+}
+
+VRC7SOUND_API bool vrc7_enable_events(struct vrc7_sound *vrc7_s, uint32_t capacity) {
+	free(vrc7_s->events);
+	vrc7_s->events = NULL;
+	vrc7_s->event_mask = 0;
+	vrc7_s->event_read = vrc7_s->event_write = 0;
+	if (capacity == 0)
+		return true;
+
+	//Round capacity up to a power of two so indices can be masked
+	uint32_t size = 1;
+	while (size < capacity && size < 0x80000000u)
+		size <<= 1;
+
+	vrc7_s->events = (struct vrc7_event *) calloc(size, sizeof(struct vrc7_event));
+	if (!vrc7_s->events)
+		return false;
+	vrc7_s->event_mask = size - 1;
+	return true;
+}
+
+VRC7SOUND_API uint32_t vrc7_read_events(struct vrc7_sound *vrc7_s, struct vrc7_event *events, uint32_t max_events) {
+	uint32_t count = 0;
+	while (count < max_events && vrc7_s->event_read != vrc7_s->event_write) {
+		events[count++] = vrc7_s->events[vrc7_s->event_read & vrc7_s->event_mask];
+		vrc7_s->event_read++;
+	}
+	return count;
+}
+
 VRC7SOUND_API void vrc7_write_data(struct vrc7_sound *vrc7_s, uint32_t data) {
 	int channel_num = vrc7_s->address & 0x0f;
 	struct vrc7_patch *user_tone = vrc7_s->patches[0];
@@ -770,6 +1768,13 @@ VRC7SOUND_API void vrc7_write_data(struct vrc7_sound *vrc7_s, uint32_t data) {
 	}
 #endif
 
+	if (vrc7_s->events) {
+		if (vrc7_s->address < 0x08)
+			push_event(vrc7_s, VRC7_EVENT_USER_PATCH, (uint8_t)vrc7_s->address, (uint16_t)(data & 0xff));
+		else if (vrc7_s->address == 0x0e && vrc7_s->chip_type == VRC7_CHIP_YM2413)
+			push_event(vrc7_s, VRC7_EVENT_RHYTHM, RHYTHM_FIRST_CHANNEL, (uint16_t)(data & 0x3f));
+	}
+
 	switch (vrc7_s->address) {
 	case 0x00:
 		user_tone->mult[MODULATOR] = data & 0x0f;
@@ -777,7 +1782,7 @@ VRC7SOUND_API void vrc7_write_data(struct vrc7_sound *vrc7_s, uint32_t data) {
 		user_tone->sustained[MODULATOR] = BIT_TEST(data, 5);
 		user_tone->vibrato[MODULATOR] = BIT_TEST(data, 6);
 		user_tone->tremolo[MODULATOR] = BIT_TEST(data, 7);
-		update_user_tone(vrc7_s);
+		vrc7_s->user_tone_dirty = true;
 		break;
 	case 0x01:
 		user_tone->mult[CARRIER] = data & 0x0f;
@@ -785,39 +1790,39 @@ VRC7SOUND_API void vrc7_write_data(struct vrc7_sound *vrc7_s, uint32_t data) {
 		user_tone->sustained[CARRIER] = BIT_TEST(data, 5);
 		user_tone->vibrato[CARRIER] = BIT_TEST(data, 6);
 		user_tone->tremolo[CARRIER] = BIT_TEST(data, 7);
-		update_user_tone(vrc7_s);
+		vrc7_s->user_tone_dirty = true;
 		break;
 	case 0x02:
 		user_tone->total_level = data & 0x3f;
 		user_tone->key_scale_level[MODULATOR] = data >> 6;
-		update_user_tone(vrc7_s);
+		vrc7_s->user_tone_dirty = true;
 		break;
 	case 0x03:
 		user_tone->feedback = data & 0x07;
 		user_tone->rect[MODULATOR] = BIT_TEST(data, 3);
 		user_tone->rect[CARRIER] = BIT_TEST(data, 4);
 		user_tone->key_scale_level[CARRIER] = data >> 6;
-		update_user_tone(vrc7_s);
+		vrc7_s->user_tone_dirty = true;
 		break;
 	case 0x04:
 		user_tone->attack_rate[MODULATOR] = data >> 4;
 		user_tone->decay_rate[MODULATOR] = data & 0x0f;
-		update_user_tone(vrc7_s);
+		vrc7_s->user_tone_dirty = true;
 		break;
 	case 0x05:
 		user_tone->attack_rate[CARRIER] = data >> 4;
 		user_tone->decay_rate[CARRIER] = data & 0x0f;
-		update_user_tone(vrc7_s);
+		vrc7_s->user_tone_dirty = true;
 		break;
 	case 0x06:
 		user_tone->sustain_level[MODULATOR] = data >> 4;
 		user_tone->release_rate[MODULATOR] = data & 0x0f;
-		update_user_tone(vrc7_s);
+		vrc7_s->user_tone_dirty = true;
 		break;
 	case 0x07:
 		user_tone->sustain_level[CARRIER] = data >> 4;
 		user_tone->release_rate[CARRIER] = data & 0x0f;
-		update_user_tone(vrc7_s);
+		vrc7_s->user_tone_dirty = true;
 		break;
 	case 0x0f:	//Test register
 		vrc7_s->test_envelope = BIT_TEST(data, 0);
@@ -825,38 +1830,89 @@ VRC7SOUND_API void vrc7_write_data(struct vrc7_sound *vrc7_s, uint32_t data) {
 		vrc7_s->test_halt_phase = BIT_TEST(data, 2);
 		vrc7_s->test_counters = BIT_TEST(data, 3);
 		break;
+	case 0x0e:	//Rhythm control, YM2413 only
+		if (vrc7_s->chip_type == VRC7_CHIP_YM2413) {
+			bool prev_keys[VRC7_MAX_CHANNELS - RHYTHM_FIRST_CHANNEL][2];
+			for (int i = RHYTHM_FIRST_CHANNEL; i < VRC7_MAX_CHANNELS; i++) {
+				prev_keys[i - RHYTHM_FIRST_CHANNEL][MODULATOR] = get_slot_key(vrc7_s, i, MODULATOR);
+				prev_keys[i - RHYTHM_FIRST_CHANNEL][CARRIER] = get_slot_key(vrc7_s, i, CARRIER);
+			}
+
+			vrc7_s->rhythm = BIT_TEST(data, 5);
+			vrc7_s->rhythm_keys = data & 0x1f;
+
+			for (int i = RHYTHM_FIRST_CHANNEL; i < VRC7_MAX_CHANNELS; i++) {
+				update_keys(vrc7_s, i, prev_keys[i - RHYTHM_FIRST_CHANNEL]);
+			}
+
+			//Both the patches (when switching rhythm mode) and the keys of channels 6-8 may have changed
+			vrc7_s->dirty_channels |= 0x7 << RHYTHM_FIRST_CHANNEL;
+		}
+		break;
 	default:
-		if (channel_num >= VRC7_NUM_CHANNELS)
+		if (channel_num >= (int)vrc7_s->num_channels)
 			return;
 
 		struct vrc7_channel *channel = vrc7_s->channels[channel_num];
 
+		uint16_t prev_pitch = get_pitch(channel);
+
 		if ((vrc7_s->address & 0xf0) == 0x10) {			//Fnum
-			set_fnum(vrc7_s, channel_num, (channel->fNum & 0x100) + data);
+			channel->fNum = (channel->fNum & 0x100) + data;
+			vrc7_s->dirty_channels |= 1 << channel_num;
+
+			if (vrc7_s->events && get_pitch(channel) != prev_pitch)
+				push_event(vrc7_s, VRC7_EVENT_PITCH, (uint8_t)channel_num, get_pitch(channel));
 		}
 		else if ((vrc7_s->address & 0xf0) == 0x20) {	//Octave/sustain/trigger
 			bool prev_trigger = channel->trigger;
+			bool prev_keys[2];
+			prev_keys[MODULATOR] = get_slot_key(vrc7_s, channel_num, MODULATOR);
+			prev_keys[CARRIER] = get_slot_key(vrc7_s, channel_num, CARRIER);
 			channel->fNum = (channel->fNum & 0xff) + ((data & 0x01) << 8);
 			channel->trigger = BIT_TEST(data, 4);
 			channel->sustain = BIT_TEST(data, 5);
 
 			//Restart envelopes if trigger changes from 0 to 1
-			if (channel->trigger && !prev_trigger) {
-				channel->slots[MODULATOR]->restart_env = true;
-				channel->slots[CARRIER]->restart_env = true;
-			}
+			update_keys(vrc7_s, channel_num, prev_keys);
 
-			//Setting the octave will update all the other stuff as well
-			set_octave(vrc7_s, channel_num, (data >> 1) & 0x07);
+			channel->octave = (data >> 1) & 0x07;
+			vrc7_s->dirty_channels |= 1 << channel_num;
+
+			//Report the pitch first, so a key on carries the pitch it starts with
+			if (vrc7_s->events) {
+				if (get_pitch(channel) != prev_pitch)
+					push_event(vrc7_s, VRC7_EVENT_PITCH, (uint8_t)channel_num, get_pitch(channel));
+				if (channel->trigger != prev_trigger)
+					push_event(vrc7_s, channel->trigger ? VRC7_EVENT_KEY_ON : VRC7_EVENT_KEY_OFF, (uint8_t)channel_num, get_pitch(channel));
+			}
 		}
 		else if ((vrc7_s->address & 0xf0) == 0x30) {	//Instrument/volume
+			uint32_t prev_volume = channel->volume;
+			uint32_t prev_instrument = channel->instrument;
 			channel->volume = data & 0x0f;
-
-			set_instrument(vrc7_s, channel_num, data >> 4);
+			channel->instrument = data >> 4;
+			vrc7_s->dirty_channels |= 1 << channel_num;
+
+			if (vrc7_s->events) {
+				if (channel->instrument != prev_instrument)
+					push_event(vrc7_s, VRC7_EVENT_INSTRUMENT, (uint8_t)channel_num, (uint16_t)channel->instrument);
+				if (channel->volume != prev_volume)
+					push_event(vrc7_s, VRC7_EVENT_VOLUME, (uint8_t)channel_num, (uint16_t)channel->volume);
+			}
 		}
 	}
 }
 
+VRC7SOUND_API void vrc7_write_batch(struct vrc7_sound *vrc7_s, const struct vrc7_write *writes, size_t count) {
+	//Writes only store values and mark channels as dirty, so repeated writes to the same register or channel
+	//collapse into a single update before the next tick. Key-on edges are still detected for every write.
+	for (size_t i = 0; i < count; i++) {
+		vrc7_s->address = writes[i].addr;
+		vrc7_write_data(vrc7_s, writes[i].data);
+	}
+}
+
 /*
 ==================================================
                VRC7 PATCH UTILITY
@@ -946,79 +2002,186 @@ VRC7SOUND_API void vrc7_get_default_patch(int set, uint32_t index, struct vrc7_p
 	vrc7_reg_to_patch(start, patch);
 }
 
+VRC7SOUND_API const struct vrc7_patch_bank *vrc7_get_patch_bank(int set) {
+	make_tables();
+	return &default_banks[set];
+}
+
+VRC7SOUND_API void vrc7_derive_patch(const struct vrc7_patch *patch, struct vrc7_patch_derived *derived) {
+	derive_patch(patch, derived);
+}
+
+VRC7SOUND_API struct vrc7_patch_bank *vrc7_patch_bank_from_memory(const uint8_t *data, size_t length) {
+	//Determine layout of the data
+	uint32_t stride;
+	if (length >= VRC7_NUM_PATCHES * 16)
+		stride = 16;
+	else if (length >= VRC7_NUM_PATCHES * 8)
+		stride = 8;
+	else
+		return NULL;
+
+	struct vrc7_patch_bank *bank = (struct vrc7_patch_bank *) calloc(1, sizeof(struct vrc7_patch_bank));
+	if (!bank)
+		return NULL;
+
+	if (length >= (VRC7_NUM_PATCHES + VRC7_NUM_RHYTHM_PATCHES) * stride) {
+		load_bank(data, stride, VRC7_NUM_PATCHES + VRC7_NUM_RHYTHM_PATCHES, bank);
+	}
+	else {
+		//No rhythm patches in the data, use the ones from the YM2413
+		make_tables();
+		*bank = default_banks[OPLL_2413_TONE];
+		load_bank(data, stride, VRC7_NUM_PATCHES, bank);
+	}
+	return bank;
+}
+
+VRC7SOUND_API struct vrc7_patch_bank *vrc7_patch_bank_from_file(const char *filename) {
+	FILE *file;
+#ifdef _MSC_VER
+	if (fopen_s(&file, filename, "rb") != 0)
+		file = NULL;
+#else
+	file = fopen(filename, "rb");
+#endif
+	if (!file)
+		return NULL;
+
+	//Read at most 16 regular and 3 rhythm patches
+	uint8_t data[(VRC7_NUM_PATCHES + VRC7_NUM_RHYTHM_PATCHES) * 16];
+	size_t length = fread(data, 1, sizeof(data), file);
+	fclose(file);
+
+	return vrc7_patch_bank_from_memory(data, length);
+}
+
+VRC7SOUND_API void vrc7_patch_bank_delete(struct vrc7_patch_bank *bank) {
+	free(bank);
+}
+
 /*
 ==================================================
 			  VRC7 FILTER FUNCTIONS
 ==================================================
 */
 
+/*
+The filters below work on a single side/stem at a time. Filter state is passed in explicitly,
+so that every vrc7_sound object and every stem has its own state.
+*/
+static void filter_no_filter(int16_t *signal) {
+	int16_t sum = current_kernels()->sum(signal);
+	sum <<= 6;
+	current_kernels()->fill(signal, sum);
+}
+
+#ifdef VRC7_SOUND_FIXED_POINT
+static void filter_lagrange_point(int16_t *signal, vrc7_filter_value fir, vrc7_filter_value iir, vrc7_filter_value *prev_input, vrc7_filter_value *prev_output) {
+	for (int j = 0; j < VRC7_SIGNAL_CHUNK_LENGTH; j++) {
+		//Apply filter. The input is an integer, the output is kept in Q16 format.
+		int64_t output = ((*prev_input + signal[j]) * fir * (1 << FILTER_OUTPUT_SHIFT)
+			+ *prev_output * iir) >> FILTER_COEFF_SHIFT;
+		*prev_input = signal[j];
+		*prev_output = output;
+
+		signal[j] = (int16_t)((output * FILTER_GAIN) >> (2 * FILTER_OUTPUT_SHIFT));
+	}
+}
+
+static int16_t filter_lagrange_point_step(int16_t input, vrc7_filter_value fir, vrc7_filter_value iir, vrc7_filter_value *prev_input, vrc7_filter_value *prev_output) {
+	//Apply filter
+	int64_t output = ((*prev_input + input) * fir * (1 << FILTER_OUTPUT_SHIFT)
+		+ *prev_output * iir) >> FILTER_COEFF_SHIFT;
+	*prev_input = input;
+	*prev_output = output;
+
+	return (int16_t)((output * FILTER_GAIN_FAST) >> (2 * FILTER_OUTPUT_SHIFT));
+}
+#else
+static void filter_lagrange_point(int16_t *signal, vrc7_filter_value fir, vrc7_filter_value iir, vrc7_filter_value *prev_input, vrc7_filter_value *prev_output) {
+	for (int j = 0; j < VRC7_SIGNAL_CHUNK_LENGTH; j++) {
+		//Apply filter
+		float output = *prev_input * fir
+			+ signal[j] * fir
+			+ *prev_output * iir;
+		*prev_input = signal[j];
+		*prev_output = output;
+
+		signal[j] = (int16_t)(output * VRC7_AMPLIFIER_GAIN * 256);	//Arbitrary constant, but seems to fit
+	}
+}
+
+static int16_t filter_lagrange_point_step(int16_t input, vrc7_filter_value fir, vrc7_filter_value iir, vrc7_filter_value *prev_input, vrc7_filter_value *prev_output) {
+	//Apply filter
+	float output = *prev_input * fir
+		+ input * fir
+		+ *prev_output * iir;
+
+	*prev_input = input;
+	*prev_output = output;
+
+	output = (float) (output * VRC7_AMPLIFIER_GAIN * 3.35);
+	return (int16_t) output;
+}
+#endif
+
+/*
+Filters the sum of the chunk as a single sample and fills the chunk with the result.
+*/
+static void filter_lagrange_point_fast(int16_t *signal, vrc7_filter_value fir, vrc7_filter_value iir, vrc7_filter_value *prev_input, vrc7_filter_value *prev_output) {
+	int16_t value = filter_lagrange_point_step(current_kernels()->sum(signal), fir, iir, prev_input, prev_output);
+	current_kernels()->fill(signal, value);
+}
+
 VRC7SOUND_API void vrc7_filter_raw(struct vrc7_sound *vrc7_s) {
 	(void)vrc7_s;
 	//Nothing
 }
 
 VRC7SOUND_API void vrc7_filter_no_filter(struct vrc7_sound *vrc7_s) {
-	for (int i = 0; i < 2; i++) {
-		int side = i == 1 ? STEREO_RIGHT : STEREO_LEFT;
-		int16_t sum = 0;
-		for (int j = 0; j < VRC7_SIGNAL_CHUNK_LENGTH; j++) {
-			sum += vrc7_s->signal[side][j];
-		}
-		sum <<= 6;
-		for (int j = 0; j < VRC7_SIGNAL_CHUNK_LENGTH; j++) {
-			vrc7_s->signal[side][j] = sum;
-		}
-	}
+	filter_no_filter(vrc7_s->signal[STEREO_LEFT]);
+	if (!vrc7_s->mono)
+		filter_no_filter(vrc7_s->signal[STEREO_RIGHT]);
 }
 
 VRC7SOUND_API void vrc7_filter_lagrange_point(struct vrc7_sound *vrc7_s) {
-	static float prev_input[2] = { 0.0,0.0 };
-	static float prev_output[2] = { 0.0,0.0 };
-	float fir = vrc7_s->fir_coeff;
-	float iir = vrc7_s->iir_coeff;
-	for (int i = 0; i < 2; i++) {
+	for (int i = 0; i < (vrc7_s->mono ? 1 : 2); i++) {
 		int side = i == 1 ? STEREO_RIGHT : STEREO_LEFT;
-		for (int j = 0; j < VRC7_SIGNAL_CHUNK_LENGTH; j++) {
-			//Apply filter
-			float output = prev_input[side] * fir
-				+ vrc7_s->signal[side][j] * fir
-				+ prev_output[side] * iir;
-			prev_input[side] = vrc7_s->signal[side][j];
-			prev_output[side] = output;
-
-			vrc7_s->signal[side][j] = (int16_t)(output * VRC7_AMPLIFIER_GAIN * 256);	//Arbitrary constant, but seems to fit
-		}
+		filter_lagrange_point(vrc7_s->signal[side], vrc7_s->fir_coeff, vrc7_s->iir_coeff,
+			&vrc7_s->prev_input[side], &vrc7_s->prev_output[side]);
 	}
 }
 
 VRC7SOUND_API void vrc7_filter_lagrange_point_fast(struct vrc7_sound *vrc7_s) {
-	static float prev_input[2] = { 0.0,0.0 };
-	static float prev_output[2] = { 0.0,0.0 };
-	float fir = vrc7_s->fir_coeff_fast;
-	float iir = vrc7_s->iir_coeff_fast;
-
-	for (int i = 0; i < 2; i++) {
+	for (int i = 0; i < (vrc7_s->mono ? 1 : 2); i++) {
 		int side = i == 1 ? STEREO_RIGHT : STEREO_LEFT;
-		int16_t sum = 0;
+		filter_lagrange_point_fast(vrc7_s->signal[side], vrc7_s->fir_coeff_fast, vrc7_s->iir_coeff_fast,
+			&vrc7_s->prev_input[side], &vrc7_s->prev_output[side]);
+	}
+}
 
-		//Sum signal
-		for (int j = 0; j < VRC7_SIGNAL_CHUNK_LENGTH; j++) {
-			sum += vrc7_s->signal[side][j];
-		}
+/*
+==================================================
+			VRC7 STEM FILTER FUNCTIONS
+==================================================
+*/
 
-		//Apply filter
-		float output = prev_input[side] * fir
-			+ sum * fir
-			+ prev_output[side] * iir;
+VRC7SOUND_API void vrc7_stem_filter_raw(struct vrc7_sound *vrc7_s, struct vrc7_stem *stem) {
+	(void)vrc7_s;
+	(void)stem;
+	//Nothing
+}
 
-		prev_input[side] = sum;
-		prev_output[side] = output;
+VRC7SOUND_API void vrc7_stem_filter_no_filter(struct vrc7_sound *vrc7_s, struct vrc7_stem *stem) {
+	(void)vrc7_s;
+	filter_no_filter(stem->signal);
+}
 
-		output = (float) (output * VRC7_AMPLIFIER_GAIN * 3.35);
+VRC7SOUND_API void vrc7_stem_filter_lagrange_point(struct vrc7_sound *vrc7_s, struct vrc7_stem *stem) {
+	filter_lagrange_point(stem->signal, vrc7_s->fir_coeff, vrc7_s->iir_coeff, &stem->prev_input, &stem->prev_output);
+}
 
-		//Fill array with output value
-		for (int j = 0; j < VRC7_SIGNAL_CHUNK_LENGTH; j++) {
-			vrc7_s->signal[side][j] = (int16_t) output;
-		}
-	}
-}
\ No newline at end of file
+VRC7SOUND_API void vrc7_stem_filter_lagrange_point_fast(struct vrc7_sound *vrc7_s, struct vrc7_stem *stem) {
+	filter_lagrange_point_fast(stem->signal, vrc7_s->fir_coeff_fast, vrc7_s->iir_coeff_fast, &stem->prev_input, &stem->prev_output);
+}
@@ -39,11 +39,15 @@ Lagrange point filter analysis by kevtris:
 // <!>  Uncomment the following line when you want to have the VRC7's TEST register enabled <!>
 // #define VRC7_SOUND_TEST_REG
 
+// <!>  Uncomment the following line to render with integer math only (fixed-point stereo gains, filters and resampler) <!>
+// #define VRC7_SOUND_FIXED_POINT
+
 #ifndef VRC7_SOUND_H
 #define VRC7_SOUND_H
 
 #include <stdint.h>
 #include <stdbool.h>
+#include <stddef.h>
 
 #ifdef VRC7_SOUND_EXPORTING
 #define VRC7SOUND_API __declspec(dllexport)
@@ -53,18 +57,34 @@ Lagrange point filter analysis by kevtris:
 #define VRC7SOUND_API
 #endif
 
+#if defined(_MSC_VER)
+#define VRC7_CACHE_ALIGN __declspec(align(64))
+#else
+#define VRC7_CACHE_ALIGN __attribute__((aligned(64)))
+#endif
+
 #ifdef __cplusplus
 extern "C" {
 #endif
 
 #define VRC7_NUM_PATCHES 16
+#define VRC7_NUM_RHYTHM_PATCHES 3
 #define VRC7_NUM_CHANNELS 6
+#define VRC7_MAX_CHANNELS 9
 
 #define VRC7_SIGNAL_CHUNK_LENGTH 72
 
+#define VRC7_MAX_CHIPS 8
+
 #define VRC7_DEFAULT_CLOCK_RATE 3579545.0
 #define VRC7_DEFAULT_SAMPLE_RATE 48000.0
 
+//Host clocks per tick used by vrc7_run_clocks. This is the NES CPU clock, which runs at half the clock of the VRC7.
+#define VRC7_DEFAULT_CLOCK_DIVIDER 36
+
+//Highest factor for vrc7_set_fast_forward
+#define VRC7_MAX_FAST_FORWARD 64
+
 #define MODULATOR 0
 #define CARRIER 1
 
@@ -83,6 +103,33 @@ enum patch_sets {
 	OPLL_281B_TONE
 };
 
+enum chip_types {
+	VRC7_CHIP_VRC7 = 0,
+	VRC7_CHIP_YM2413
+};
+
+/*
+Implementations of the chunk loops (mixing, summing and filling in the filters, summing chips), see vrc7_set_kernel.
+*/
+enum vrc7_kernel_types {
+	VRC7_KERNEL_AUTO = 0,
+	VRC7_KERNEL_SCALAR,
+	VRC7_KERNEL_SSE2,
+	VRC7_KERNEL_AVX2
+};
+
+/*
+Values for the mono_mode property of vrc7_sound.
+-- VRC7_MONO_OFF:	Always mix and filter both sides.
+-- VRC7_MONO_ON:	Mix and filter only one side. Each channel uses the average of its left and right stereo_volume.
+-- VRC7_MONO_AUTO:	Same as VRC7_MONO_ON while the left and right rows of stereo_volume are identical, otherwise the same as VRC7_MONO_OFF.
+*/
+enum vrc7_mono_modes {
+	VRC7_MONO_OFF = 0,
+	VRC7_MONO_ON,
+	VRC7_MONO_AUTO
+};
+
 struct vrc7_patch {
 	uint32_t feedback;
 	uint32_t total_level;
@@ -100,6 +147,31 @@ struct vrc7_patch {
 	uint32_t release_rate[2];
 };
 
+#define VRC7_NUM_KEYS_KSL 128
+#define VRC7_NUM_KEYS_RATE 16
+
+/*
+Values that only depend on a single patch. These are computed once when the patch is loaded, so that they don't
+have to be decoded again during emulation. The key dependent tables are indexed by
+(octave << 4) | (fNum >> 5) for ksl and (octave << 1) | (fNum >> 8) for rate_low.
+*/
+struct vrc7_patch_derived {
+	uint32_t feedback_shift;
+	uint32_t mult_x8[2];
+	uint8_t ksl[2][VRC7_NUM_KEYS_KSL];
+	uint8_t rate_low[2][VRC7_NUM_KEYS_RATE];
+	uint8_t key_scale[2][8];
+};
+
+/*
+A fully decoded set of instruments, including the three rhythm patches used by the YM2413. Banks are created with vrc7_patch_bank_from_memory or vrc7_patch_bank_from_file and
+selected with vrc7_set_patch_bank. Switching to a bank does not decode anything, so it is cheap to switch between several loaded banks.
+*/
+struct vrc7_patch_bank {
+	struct vrc7_patch patches[VRC7_NUM_PATCHES + VRC7_NUM_RHYTHM_PATCHES];
+	struct vrc7_patch_derived derived[VRC7_NUM_PATCHES + VRC7_NUM_RHYTHM_PATCHES];
+};
+
 struct vrc7_slot {
 	uint32_t type;
 	int32_t sample;
@@ -107,8 +179,10 @@ struct vrc7_slot {
 
 	uint32_t phase;
 	uint32_t phase_inc;
+	uint32_t phase_step;	//phase_inc including the current vibrato
 
 	uint32_t ksl_val;
+	uint32_t tremolo_val;
 
 	uint32_t env_rate_high;
 	uint32_t env_rate_low;
@@ -129,6 +203,97 @@ struct vrc7_channel {
 	struct vrc7_slot *slots[2];
 };
 
+/*
+Type of filter coefficients and filter state. With VRC7_SOUND_FIXED_POINT, coefficients are stored in Q30 format and filter outputs in Q16 format.
+*/
+#ifdef VRC7_SOUND_FIXED_POINT
+typedef int64_t vrc7_filter_value;
+#else
+typedef float vrc7_filter_value;
+#endif
+
+/*
+Position of the nearest-neighbour resampler. With VRC7_SOUND_FIXED_POINT, the step is split into whole clock cycles and a remainder
+in units of 1/sample_rate, so the position is exact for integer clock and sample rates.
+*/
+struct vrc7_time {
+#ifdef VRC7_SOUND_FIXED_POINT
+	uint32_t step;
+	uint32_t step_frac;
+	uint32_t unit;
+	uint32_t current;
+	uint32_t current_frac;
+#else
+	double step;
+	double current;
+#endif
+};
+
+/*
+Per-channel output tap. See the stems property of vrc7_sound.
+*/
+struct vrc7_stem {
+	int16_t *signal;
+
+	//private:
+	vrc7_filter_value prev_input;
+	vrc7_filter_value prev_output;
+};
+
+/*
+Level of a single meter. See vrc7_read_meters.
+-- peak:	Largest absolute value in the window.
+-- rms:		Root mean square of the values in the window.
+*/
+struct vrc7_meter {
+	uint32_t peak;
+	double rms;
+};
+
+/*
+Levels returned by vrc7_read_meters. All values use the scale of the unfiltered signal.
+-- channels:	Output of each channel per tick, before channel_mask and stereo_volume are applied (the same signal as the stems).
+-- master:		Sum of the mix per tick for each side, before the output filter.
+-- ticks:		Number of ticks in the window.
+*/
+struct vrc7_meters {
+	struct vrc7_meter channels[VRC7_MAX_CHANNELS];
+	struct vrc7_meter master[2];
+	uint32_t ticks;
+};
+
+enum vrc7_event_types {
+	VRC7_EVENT_KEY_ON,		//A channel was keyed on. value contains the pitch.
+	VRC7_EVENT_KEY_OFF,		//A channel was keyed off. value contains the pitch.
+	VRC7_EVENT_PITCH,		//fNum or octave of a channel changed. value contains the pitch.
+	VRC7_EVENT_INSTRUMENT,	//The instrument of a channel changed. value contains the instrument (0-15).
+	VRC7_EVENT_VOLUME,		//The volume register of a channel changed. value contains the volume (0-15, 0 is the loudest).
+	VRC7_EVENT_USER_PATCH,	//A user tone register was written. channel contains the register (0-7), value the data.
+	VRC7_EVENT_RHYTHM		//The rhythm register was written (YM2413 only). value contains the data.
+};
+
+/*
+An event returned by vrc7_read_events.
+-- tick:		Number of ticks that had been rendered when the event happened (see tick_count).
+-- type:		One of vrc7_event_types.
+-- channel:		The channel the event belongs to.
+-- value:		Depends on the type. Pitches are stored as fNum | octave << 9.
+*/
+struct vrc7_event {
+	uint64_t tick;
+	uint8_t type;
+	uint8_t channel;
+	uint16_t value;
+};
+
+/*
+A single register write for vrc7_write_batch.
+*/
+struct vrc7_write {
+	uint8_t addr;
+	uint8_t data;
+};
+
 /*
 This is the main object. You can/have to change some properties directly via this struct. These are:
 -- channel_mask:	Bit field that enables or disables some channels of the VRC7. Setting a bit to 1 will disable that channel.
@@ -136,40 +301,122 @@ This is the main object. You can/have to change some properties directly via thi
 -- filter:			Filter function that is applied to the raw output of the VRC7. It can be set to any of the vrc7_filter_* functions below.
 					The default is vrc7_filter_lagrange_point_fast.
 -- stereo_volume:	Volume control for each channel. This is a 2d-array. The first dimension selects the stereo channel with either STEREO_LEFT or STEREO_RIGHT.
-					The second dimension selects the VRC7 channel (from 0 to VRC7_NUM_CHANNELS). The default value is 1.0 (full volume)
+					The second dimension selects the VRC7 channel (from 0 to num_channels). The default value is 1.0 (full volume)
 					for every side and channel.
 
+-- stems:			Optional per-channel outputs. Setting stems[n].signal to a buffer of length VRC7_SIGNAL_CHUNK_LENGTH makes vrc7_tick write the
+					output of channel n into that buffer during the same pass that creates the mix. The stems contain the carrier output after the
+					channel's volume register, but before channel_mask and stereo_volume are applied. The default is NULL (no output) for every channel.
+-- stem_filter:		Filter function that is applied to every enabled stem. It can be set to any of the vrc7_stem_filter_* functions below.
+					The default is vrc7_stem_filter_raw.
+-- meters_enabled:	Enables the per-channel and master level meters, which are updated by vrc7_tick and read with vrc7_read_meters.
+					The default is false.
+-- clock_divider:	Number of host clocks per tick for vrc7_run_clocks. The default is VRC7_DEFAULT_CLOCK_DIVIDER.
+-- mono_mode:		Selects when only one side is mixed and filtered, see enum vrc7_mono_modes. This halves the work of the mixer and the filter.
+					The default is VRC7_MONO_OFF.
+-- mono_output:		When true, vrc7_run_clocks and vrc7_resample_signal write one sample per frame (the left side) instead of stereo frames.
+					Combined with mono_mode this gives mono output without duplicating any samples. The default is false.
+-- skip_idle_channels:	When true, channels whose slots are keyed off and have decayed to the end of the release are not emulated until they
+					are keyed on again. The chip keeps these channels at about -47 dB instead of muting them; this faint residual tone is
+					dropped. The default is false.
+
 -- signal:			The output signal of the VRC7. This is an array of length VRC7_SIGNAL_CHUNK_LENGTH and contains the audio signal sampled at the clock rate.
+					While mono is true, only signal[STEREO_LEFT] is updated.
+-- mono:			True if the last tick was rendered in mono, see mono_mode. The sample functions then duplicate the left side.
+-- fast_forward:	Playback speed factor set by vrc7_set_fast_forward. 1 is normal playback.
+-- num_channels:	Number of channels of the emulated chip. This is VRC7_NUM_CHANNELS for the VRC7 and VRC7_MAX_CHANNELS for the YM2413.
+-- tick_count:		Number of ticks since the last reset.
+-- events_dropped:	Number of events that were dropped because the event buffer was full. See vrc7_enable_events.
 */
 struct vrc7_sound {
 	//Read & Write:
 	uint32_t channel_mask;
 	void(*filter)(struct vrc7_sound *vrc7_s);
-	double stereo_volume[2][VRC7_NUM_CHANNELS];
+	double stereo_volume[2][VRC7_MAX_CHANNELS];
+	struct vrc7_stem stems[VRC7_MAX_CHANNELS];
+	void(*stem_filter)(struct vrc7_sound *vrc7_s, struct vrc7_stem *stem);
+	bool meters_enabled;
+	uint32_t clock_divider;
+	int mono_mode;
+	bool mono_output;
+	bool skip_idle_channels;
 
 	//Read only:
 	int16_t *signal[2];
+	bool mono;
+	uint32_t fast_forward;
+	uint32_t num_channels;
+	uint64_t tick_count;
+	uint32_t events_dropped;
 
 	//private:
-	struct vrc7_channel *channels[VRC7_NUM_CHANNELS];
-	struct vrc7_patch *patches[VRC7_NUM_PATCHES];
+	struct vrc7_channel *channels[VRC7_MAX_CHANNELS];
+	struct vrc7_patch *patches[VRC7_NUM_PATCHES + VRC7_NUM_RHYTHM_PATCHES];
+	struct vrc7_patch_derived *derived[VRC7_NUM_PATCHES + VRC7_NUM_RHYTHM_PATCHES];
+	const struct vrc7_patch_bank *patch_bank;
 	double clock_rate;
 	double sample_rate;
-	double sample_length;
-	double current_time;
+	struct vrc7_time time;
+	uint32_t clock_counter;
 	uint32_t vibrato_counter;
 	uint32_t tremolo_value;
 	int32_t tremolo_inc;
+	uint32_t lfo_step;
 	uint32_t envelope_counter;
 	uint32_t zero_count;
 	uint32_t mini_counter;
 	int patch_set;
 	uint32_t address;
-
-	float fir_coeff;
-	float iir_coeff;
-	float fir_coeff_fast;
-	float iir_coeff_fast;
+	bool user_tone_dirty;
+	uint32_t dirty_channels;
+	int chip_type;
+	bool rhythm;
+	uint32_t rhythm_keys;
+	uint32_t noise;
+
+	vrc7_filter_value fir_coeff;
+	vrc7_filter_value iir_coeff;
+	vrc7_filter_value fir_coeff_fast;
+	vrc7_filter_value iir_coeff_fast;
+	vrc7_filter_value prev_input[2];
+	vrc7_filter_value prev_output[2];
+	bool filter_mono;
+
+	//Fast-forward decimator and filter, see vrc7_set_fast_forward
+	vrc7_filter_value fir_coeff_ff;
+	vrc7_filter_value iir_coeff_ff;
+	vrc7_filter_value ff_prev_input[2];
+	vrc7_filter_value ff_prev_output[2];
+	int32_t ff_sum[2];
+	uint32_t ff_ticks;
+	int16_t ff_input[2];
+	int16_t ff_output[2];
+	bool ff_rendered;
+
+	//Mix matrix, precalculated from stereo_volume and channel_mask
+#ifdef VRC7_SOUND_FIXED_POINT
+	int32_t stereo_gain[2][VRC7_MAX_CHANNELS];
+#else
+	double stereo_gain[2][VRC7_MAX_CHANNELS];
+#endif
+	double stereo_gain_source[2][VRC7_MAX_CHANNELS];
+	uint32_t stereo_gain_mask;
+	int stereo_gain_mono_mode;
+	bool stereo_gain_mono;
+	bool unity_gain;
+
+	//Level meter accumulators
+	uint32_t meter_peak[VRC7_MAX_CHANNELS];
+	uint64_t meter_sum[VRC7_MAX_CHANNELS];
+	uint32_t master_peak[2];
+	uint64_t master_sum[2];
+	uint32_t meter_ticks;
+
+	//Event buffer
+	struct vrc7_event *events;
+	uint32_t event_mask;
+	uint32_t event_read;
+	uint32_t event_write;
 
 	bool test_envelope;
 	bool test_reset_fmam;
@@ -178,6 +425,100 @@ struct vrc7_sound {
 
 };
 
+/*
+Container for several chips that run on one shared timebase. The chips are ticked together, their unfiltered outputs are
+summed and the filter and resampler run only once for the mix.
+-- filter:			Filter function that is applied to the mix. It can be set to any of the vrc7_filter_* functions below and is called with
+					chips[0], which holds the mix and the filter state. The filters of the individual chips are not used.
+					The default is vrc7_filter_lagrange_point_fast.
+
+-- chips:			The emulated chips. Registers are written with the regular IO functions, e.g. vrc7_write_data(multi->chips[1], data).
+					Per-chip settings like channel_mask, stereo_volume, stems or the patch set still apply.
+-- signal:			The mixed output signal, see the signal property of vrc7_sound.
+*/
+struct vrc7_multi {
+	//Read & Write:
+	void(*filter)(struct vrc7_sound *vrc7_s);
+
+	//Read only:
+	uint32_t num_chips;
+	struct vrc7_sound *chips[VRC7_MAX_CHIPS];
+	int16_t *signal[2];
+
+	//private:
+	double sample_rate;
+	struct vrc7_time time;
+};
+
+/*
+Register and slot state of one channel in packed form. See vrc7_packed_state.
+-- modulator:	phase (bits 0-18), env_value (19-25), env_stage (26-27), env_enabled (28), restart_env (29), sample (32-43), sample_prev (44-55).
+-- carrier:		Same as the lower 32 bits of modulator. The samples of carriers are never fed back, so they are not stored.
+-- regs:		fNum (bits 0-8), octave (9-11), volume (12-15), instrument (16-19), sustain (20), trigger (21).
+*/
+struct vrc7_packed_channel {
+	uint64_t modulator;
+	uint32_t carrier;
+	uint32_t regs;
+};
+
+/*
+Complete emulation state of a chip with every field stored at its register width. This is a storage format for keeping thousands of
+instances in memory, not the format the emulation runs on: rendering always happens in a vrc7_sound object, and instances are moved in
+and out of one with vrc7_pack_state and vrc7_unpack_state. Unpacking recalculates all precalculated values, so switching instances
+costs more than a tick.
+
+Size budget (sizeof(struct vrc7_packed_state) == 192, aligned to 64 bytes):
+-- Bytes   0- 95:	channels 0-5, 16 bytes each
+-- Bytes  96-127:	user tone (in register format), LFO and envelope counters, address, rhythm and test registers, noise generator
+-- Bytes 128-191:	channels 6-8 of the YM2413
+A stored VRC7 instance only uses the first two cache lines. Instances in an array allocated with vrc7_packed_state_array_new never share
+a cache line.
+
+Everything that can be calculated from the registers (phase increments, key scaling, envelope rates) is not stored.
+The patch bank, chip type, filter state and resampler position are not part of the packed state either.
+*/
+struct VRC7_CACHE_ALIGN vrc7_packed_state {
+	struct vrc7_packed_channel channels[VRC7_NUM_CHANNELS];
+	uint8_t user_patch[8];
+	uint32_t noise;
+	uint16_t vibrato_counter;
+	uint16_t envelope_counter;
+	uint8_t tremolo_value;
+	uint8_t counters;			//mini_counter (bits 0-1), zero_count (2-5), tremolo decreasing (6)
+	uint8_t address;
+	uint8_t rhythm;				//Same layout as register $0E
+	uint8_t test;				//Same layout as register $0F
+	uint8_t reserved0[11];
+	struct vrc7_packed_channel ym2413_channels[VRC7_MAX_CHANNELS - VRC7_NUM_CHANNELS];
+	uint8_t reserved1[16];
+};
+
+/*
+Everything needed to continue rendering from a point in time: the packed emulation state plus the output filter, the resampler position
+and the current signal chunk. Created with vrc7_save_state and restored with vrc7_load_state.
+The layout is fixed (sizeof(struct vrc7_snapshot) == 576) and does not depend on VRC7_SOUND_FIXED_POINT, so snapshots can be stored in files.
+-- chip:			See vrc7_packed_state.
+-- prev_input:		Output filter state, per side.
+-- prev_output:		Output filter state, per side. Always stored in the unit of the floating point build; the fixed point build converts
+					from and to its Q16 format.
+-- time:			Resampler position within the current chunk, in clock cycles.
+-- tick_count:		See tick_count of vrc7_sound.
+-- clock_counter:	Host clocks that vrc7_run_clocks has not turned into a tick yet.
+-- signal:			The current signal chunk, or zeros if no samples of it are due anymore.
+*/
+struct VRC7_CACHE_ALIGN vrc7_snapshot {
+	struct vrc7_packed_state chip;
+	double prev_input[2];
+	double prev_output[2];
+	double time;
+	uint64_t tick_count;
+	uint32_t clock_counter;
+	uint32_t reserved0;
+	int16_t signal[2][VRC7_SIGNAL_CHUNK_LENGTH];
+	uint8_t reserved1[40];
+};
+
 /*
 =============  VRC7 Sound Management  ==============
 */
@@ -193,7 +534,7 @@ Deletes a vrc7_sound object.
 VRC7SOUND_API void vrc7_delete(struct vrc7_sound *vrc7_s);
 
 /*
-Manually resets a vrc7_sound object to it's default values.
+Manually resets a vrc7_sound object to it's default values. The chip type set by vrc7_set_chip_type is kept.
 */
 VRC7SOUND_API void vrc7_reset(struct vrc7_sound *vrc7_s);
 
@@ -203,6 +544,13 @@ but clears the values that would be cleared by disabling the expansion sound (se
 */
 VRC7SOUND_API void vrc7_clear(struct vrc7_sound *vrc7_s);
 
+/*
+Selects the emulated chip. This can be any value from the chip_types enum. VRC7_CHIP_YM2413 enables all 9 channels as well as
+the rhythm mode (register $0E), and defaults to the OPLL_2413_TONE patch set. This function also resets the vrc7_sound object.
+The default is VRC7_CHIP_VRC7.
+*/
+VRC7SOUND_API void vrc7_set_chip_type(struct vrc7_sound *vrc7_s, int chip_type);
+
 /*
 Sets the clock rate of the vrc7. This will also change the sample rate of vrc7_sound->signal. 
 The default is 3579545.0 Hz (VRC7_DEFAULT_CLOCK_RATE).
@@ -216,22 +564,165 @@ confused with the sample rate of the signal variable of the vrc7_sound object wh
 VRC7SOUND_API void vrc7_set_sample_rate(struct vrc7_sound *vrc7_s, double sample_rate);
 
 /*
-Sets the instrument data for the vrc7's build-in patches. This can be any value from the patch_sets enum. The default is VRC7_NUKE_TONE.
+Plays back factor times faster (1 to VRC7_MAX_FAST_FORWARD, 1 is normal playback). Every sample fetched with vrc7_fetch_sample or
+vrc7_run_clocks then covers factor times as much emulated time. The ticks are only emulated: the chunks are not filtered but averaged
+into one value per sample, which goes through a cheap filter that runs at the sample rate. Stems are sampled as usual.
+Only use this with vrc7_fetch_sample, vrc7_fetch_sample_stems and vrc7_run_clocks, not when calling vrc7_tick yourself.
+When going back to normal playback, the rest of the current chunk holds the last fast-forward sample.
+*/
+VRC7SOUND_API void vrc7_set_fast_forward(struct vrc7_sound *vrc7_s, uint32_t factor);
+
+/*
+Sets the instrument data for the vrc7's build-in patches. This can be any value from the patch_sets enum. The default is VRC7_NUKE_TONE
+(OPLL_2413_TONE for the YM2413).
 */
 VRC7SOUND_API void vrc7_set_patch_set(struct vrc7_sound *vrc7_s, int patch_set);
 
+/*
+Selects the implementation of the chunk loops for all vrc7_sound objects. This can be any value from the vrc7_kernel_types enum.
+VRC7_KERNEL_AUTO selects the fastest one the CPU supports. All implementations produce the same output, so this is only useful for testing
+and benchmarking. Returns false if the CPU does not support the implementation; the selection is then not changed.
+The first vrc7_new selects VRC7_KERNEL_AUTO, unless vrc7_set_kernel was called before or the environment variable VRC7_SOUND_KERNEL
+is set to scalar, sse2 or avx2. The selection is shared by all threads and may be changed while other threads render.
+*/
+VRC7SOUND_API bool vrc7_set_kernel(int kernel);
+
+/*
+Returns the selected implementation of the chunk loops (never VRC7_KERNEL_AUTO).
+*/
+VRC7SOUND_API int vrc7_get_kernel(void);
+
+/*
+Sets the instrument data for the vrc7's build-in patches from a patch bank. Patch 0 of the bank is copied into the user tone,
+all other patches are used directly from the bank, so the bank has to stay valid until another patch set or bank is selected or
+the vrc7_sound object is deleted.
+*/
+VRC7SOUND_API void vrc7_set_patch_bank(struct vrc7_sound *vrc7_s, const struct vrc7_patch_bank *bank);
+
 /*
 Updates the vrc7. This function has to be called at 1/72th of the clock rate set by vrc7_set_clock_rate. After calling this function,
 the signal variable of the vrc7_sound object will contain new data. If you are using vrc7_fetch_sample, you should not call this function.
 */
 VRC7SOUND_API void vrc7_tick(struct vrc7_sound *vrc7_s);
 
+/*
+Returns the levels since the last call and starts a new window. Requires meters_enabled to be set.
+*/
+VRC7SOUND_API void vrc7_read_meters(struct vrc7_sound *vrc7_s, struct vrc7_meters *meters);
+
 /*
 Fetches a single sample and updates the vrc7_sound object. This function internally calls vrc7_tick, so you should not call it manually when using
 vrc7_fetch_sample. This function has to be called at the sample rate set by vrc7_set_sample_rate.
 */
 VRC7SOUND_API void vrc7_fetch_sample(struct vrc7_sound *vrc7_s, int16_t *sample);
 
+/*
+Same as vrc7_fetch_sample, but also resamples the enabled stems. stem_samples has to have room for VRC7_MAX_CHANNELS values,
+entry n receives the sample of channel n or 0 if that channel's stem is disabled.
+*/
+VRC7SOUND_API void vrc7_fetch_sample_stems(struct vrc7_sound *vrc7_s, int16_t *sample, int16_t *stem_samples);
+
+/*
+Advances the vrc7 by cpu_clocks host clocks and writes the samples that become due into out as interleaved stereo frames (single samples if
+mono_output is set). The remainder of clocks that do not make up a whole tick (see clock_divider) is kept for the next call, so this function
+can be called once per scanline or frame with any number of clocks. Samples are produced at the sample rate set by vrc7_set_sample_rate, exactly like vrc7_fetch_sample would.
+Samples beyond max_frames are dropped. out may be NULL to run the emulation only; the signal variable then contains the last tick.
+Returns the number of frames written to out.
+*/
+VRC7SOUND_API uint32_t vrc7_run_clocks(struct vrc7_sound *vrc7_s, uint32_t cpu_clocks, int16_t *out, uint32_t max_frames);
+
+/*
+Resamples the current contents of the signal variable: writes the samples that fall into it into out as interleaved stereo frames (single
+samples if mono_output is set) and moves the resampler on to the next chunk. Samples beyond max_frames are dropped. Returns the number of
+frames written to out.
+Together with vrc7_tick this produces the same samples as vrc7_fetch_sample. It is meant for hosts that filter the signal themselves,
+call it once before the first vrc7_tick and once after every tick.
+*/
+VRC7SOUND_API uint32_t vrc7_resample_signal(struct vrc7_sound *vrc7_s, int16_t *out, uint32_t max_frames);
+
+/*
+Enables recording of key, pitch, instrument, volume, user tone and rhythm changes made by vrc7_write_data into a ring buffer of
+capacity events (rounded up to a power of two). A capacity of 0 disables recording and frees the buffer. When the buffer is full, new
+events are dropped and counted in events_dropped. Returns false if the buffer could not be allocated.
+The buffer is not synchronized, so events have to be read on the thread that writes to the vrc7.
+*/
+VRC7SOUND_API bool vrc7_enable_events(struct vrc7_sound *vrc7_s, uint32_t capacity);
+
+/*
+Moves up to max_events of the oldest recorded events into events and returns how many were copied.
+*/
+VRC7SOUND_API uint32_t vrc7_read_events(struct vrc7_sound *vrc7_s, struct vrc7_event *events, uint32_t max_events);
+
+/*
+=============  VRC7 Multi-Chip  ==============
+*/
+
+/*
+Creates a container with num_chips (1 to VRC7_MAX_CHIPS) new vrc7_sound objects. Returns NULL if num_chips is out of range.
+*/
+VRC7SOUND_API struct vrc7_multi *vrc7_multi_new(uint32_t num_chips);
+
+/*
+Deletes a multi-chip container including its chips.
+*/
+VRC7SOUND_API void vrc7_multi_delete(struct vrc7_multi *multi);
+
+/*
+Sets the clock rate of all chips. See vrc7_set_clock_rate.
+*/
+VRC7SOUND_API void vrc7_multi_set_clock_rate(struct vrc7_multi *multi, double clock_rate);
+
+/*
+Sets the sample rate used by vrc7_multi_fetch_sample. See vrc7_set_sample_rate.
+*/
+VRC7SOUND_API void vrc7_multi_set_sample_rate(struct vrc7_multi *multi, double sample_rate);
+
+/*
+Updates all chips and fills the signal of the container with the filtered mix. This is the multi-chip version of vrc7_tick.
+*/
+VRC7SOUND_API void vrc7_multi_tick(struct vrc7_multi *multi);
+
+/*
+Fetches a single sample of the mix. This is the multi-chip version of vrc7_fetch_sample.
+*/
+VRC7SOUND_API void vrc7_multi_fetch_sample(struct vrc7_multi *multi, int16_t *sample);
+
+/*
+=============  VRC7 Packed State  ==============
+*/
+
+/*
+Stores the emulation state of vrc7_s in packed form.
+*/
+VRC7SOUND_API void vrc7_pack_state(const struct vrc7_sound *vrc7_s, struct vrc7_packed_state *state);
+
+/*
+Restores the emulation state of vrc7_s from packed form. vrc7_s must use the same chip type and patch bank as the chip the state was
+taken from. All precalculated values are updated before the next tick.
+*/
+VRC7SOUND_API void vrc7_unpack_state(struct vrc7_sound *vrc7_s, const struct vrc7_packed_state *state);
+
+/*
+Stores the complete state of vrc7_s in a snapshot.
+*/
+VRC7SOUND_API void vrc7_save_state(const struct vrc7_sound *vrc7_s, struct vrc7_snapshot *snapshot);
+
+/*
+Restores the complete state of vrc7_s from a snapshot. Besides the requirements of vrc7_unpack_state, vrc7_s must use the same clock rate,
+sample rate and filter as the chip the snapshot was taken from.
+*/
+VRC7SOUND_API void vrc7_load_state(struct vrc7_sound *vrc7_s, const struct vrc7_snapshot *snapshot);
+
+/*
+Allocates a zeroed, cache line aligned array of count packed states. Returns NULL if the allocation failed.
+*/
+VRC7SOUND_API struct vrc7_packed_state *vrc7_packed_state_array_new(size_t count);
+
+/*
+Deletes an array allocated with vrc7_packed_state_array_new.
+*/
+VRC7SOUND_API void vrc7_packed_state_array_delete(struct vrc7_packed_state *states);
+
 /*
 =============  VRC7 Sound IO  ==============
 */
@@ -246,6 +737,13 @@ Writes a value to the vrc7 register selected by vrc7_write_addr.
 */
 VRC7SOUND_API void vrc7_write_data(struct vrc7_sound *vrc7_s, uint32_t data);
 
+/*
+Applies count register writes in order, as if vrc7_write_addr and vrc7_write_data were called for each of them.
+Derived values are only updated once per affected channel before the next tick, so this is the preferred way for hosts that
+collect all writes of a frame. After the call, the address register contains the address of the last write.
+*/
+VRC7SOUND_API void vrc7_write_batch(struct vrc7_sound *vrc7_s, const struct vrc7_write *writes, size_t count);
+
 /*
 =============  VRC7 Patch Utility  ==============
 */
@@ -265,6 +763,35 @@ Loads a default patch into the vrc7_patch object.
 */
 VRC7SOUND_API void vrc7_get_default_patch(int set, uint32_t index, struct vrc7_patch *patch);
 
+/*
+Returns the decoded default patch bank of a patch set. The bank is owned by the library and must not be deleted.
+*/
+VRC7SOUND_API const struct vrc7_patch_bank *vrc7_get_patch_bank(int set);
+
+/*
+Calculates the key dependent values of a patch.
+*/
+VRC7SOUND_API void vrc7_derive_patch(const struct vrc7_patch *patch, struct vrc7_patch_derived *derived);
+
+/*
+Creates a patch bank from raw register data. The data can either contain 16 bytes per patch (the layout used by the files in patch-sets/,
+which requires at least 256 bytes) or 8 bytes per patch (at least 128 bytes). If the data also contains the three rhythm patches
+after the 16 regular patches, they are loaded as well, otherwise the rhythm patches of OPLL_2413_TONE are used.
+Returns NULL if the data is too short.
+*/
+VRC7SOUND_API struct vrc7_patch_bank *vrc7_patch_bank_from_memory(const uint8_t *data, size_t length);
+
+/*
+Creates a patch bank from a file containing raw register data as described for vrc7_patch_bank_from_memory.
+Returns NULL if the file could not be read or is too short.
+*/
+VRC7SOUND_API struct vrc7_patch_bank *vrc7_patch_bank_from_file(const char *filename);
+
+/*
+Deletes a patch bank created by vrc7_patch_bank_from_memory or vrc7_patch_bank_from_file.
+*/
+VRC7SOUND_API void vrc7_patch_bank_delete(struct vrc7_patch_bank *bank);
+
 /*
 =============  VRC7 Filter Functions  ==============
 */
@@ -291,6 +818,31 @@ up the computation of the low pass filter significantly.
 */
 VRC7SOUND_API void vrc7_filter_lagrange_point_fast(struct vrc7_sound *vrc7_s);
 
+/*
+=============  VRC7 Stem Filter Functions  ==============
+These work like the filter functions above, but operate on a single stem. Each stem keeps its own filter state.
+*/
+
+/*
+Leaves the raw channel output in the stem.
+*/
+VRC7SOUND_API void vrc7_stem_filter_raw(struct vrc7_sound *vrc7_s, struct vrc7_stem *stem);
+
+/*
+Stem version of vrc7_filter_no_filter.
+*/
+VRC7SOUND_API void vrc7_stem_filter_no_filter(struct vrc7_sound *vrc7_s, struct vrc7_stem *stem);
+
+/*
+Stem version of vrc7_filter_lagrange_point.
+*/
+VRC7SOUND_API void vrc7_stem_filter_lagrange_point(struct vrc7_sound *vrc7_s, struct vrc7_stem *stem);
+
+/*
+Stem version of vrc7_filter_lagrange_point_fast.
+*/
+VRC7SOUND_API void vrc7_stem_filter_lagrange_point_fast(struct vrc7_sound *vrc7_s, struct vrc7_stem *stem);
+
 #ifdef __cplusplus
 }
 #endif
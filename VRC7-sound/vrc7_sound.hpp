@@ -0,0 +1,873 @@
+/*
+ _     __   _____     ____   _______
+| |   / /  / ___ \   / ___\ /___   /    #####    ###    ##    #  ##    #  #####
+| |  / /  / /__/ /  / /       __/ /   ##       ##   #  ##    #  ###   #  ##    #
+| | / /  / _   _/  / /       /_  _/   ####    ##   #  ##    #  ## #  #  ##    #
+| |/ /  / / | |   / /___      / /        ##  ##   #  ##    #  ##  # #  ##    #
+|___/  /_/  |_|   \____/     /_/    #####     ###     ####   ##    #  ######
+
+
+VRC7 Audio emulator by Delphi1024
+
+Copyright 2019 Jonas Rinke
+
+C++ engine with compile-time configuration. The emulation is the same as in vrc7_sound.c and produces the same output
+(as long as the C library is not built with VRC7_SOUND_FIXED_POINT), but everything that the C version decides at runtime for a whole session is a template parameter instead:
+
+	vrc7::Chip<FilterPolicy, TestReg, Channels, Stereo>
+
+-- FilterPolicy:	One of vrc7::FilterRaw, vrc7::FilterNone, vrc7::FilterLagrangePoint or vrc7::FilterLagrangePointFast. The filter is
+					inlined into tick() instead of being called through a function pointer.
+-- TestReg:			Emulate the TEST register ($0F). This is the equivalent of VRC7_SOUND_TEST_REG, but can be chosen per instance.
+-- Channels:		VRC7_NUM_CHANNELS emulates the VRC7, VRC7_MAX_CHANNELS emulates the YM2413 including rhythm mode.
+-- Stereo:			When true, the chip produces two output signals like vrc7_sound. When false, it produces a single signal like
+					vrc7_sound with mono_mode set to VRC7_MONO_ON: each channel is mixed with the average of its two stereo_volume values.
+					Both configurations have the channel_mask and stereo_volume members of vrc7_sound.
+
+The 18-slot schedule is unrolled at compile time, so unused channels, test register branches and the stereo mixing disappear entirely.
+Chip is a value type without any heap allocations and can be copied or moved freely. Patch banks are referenced, not owned, so
+custom banks must outlive the chips that use them. Stems are not supported.
+
+The engine is header-only, but uses the patch banks and vrc7_derive_patch of the C library, so vrc7_sound.c still has to be linked.
+*/
+
+#ifndef VRC7_SOUND_HPP
+#define VRC7_SOUND_HPP
+
+#include "vrc7_sound.h"
+#include "vrc7_core.h"
+
+#include <algorithm>
+#include <cstring>
+#include <type_traits>
+
+namespace vrc7 {
+
+/*
+==================================================
+                    FILTERS
+==================================================
+*/
+
+struct FilterCoeffs {
+	float fir;
+	float iir;
+	float fir_fast;
+	float iir_fast;
+};
+
+struct FilterState {
+	float prev_input;
+	float prev_output;
+};
+
+namespace detail {
+
+//1 + 240,000 / 4,300
+static const double AMPLIFIER_GAIN = 56.81395349;
+
+}
+
+/*
+Equivalent of vrc7_filter_raw.
+*/
+struct FilterRaw {
+	static void apply(int16_t *, const FilterCoeffs &, FilterState &) {
+		//Nothing
+	}
+};
+
+/*
+Equivalent of vrc7_filter_no_filter.
+*/
+struct FilterNone {
+	static void apply(int16_t *signal, const FilterCoeffs &, FilterState &) {
+		int16_t sum = 0;
+		for (int j = 0; j < VRC7_SIGNAL_CHUNK_LENGTH; j++) {
+			sum += signal[j];
+		}
+		sum <<= 6;
+		for (int j = 0; j < VRC7_SIGNAL_CHUNK_LENGTH; j++) {
+			signal[j] = sum;
+		}
+	}
+};
+
+/*
+Equivalent of vrc7_filter_lagrange_point.
+*/
+struct FilterLagrangePoint {
+	static void apply(int16_t *signal, const FilterCoeffs &coeffs, FilterState &state) {
+		for (int j = 0; j < VRC7_SIGNAL_CHUNK_LENGTH; j++) {
+			float output = state.prev_input * coeffs.fir
+				+ signal[j] * coeffs.fir
+				+ state.prev_output * coeffs.iir;
+			state.prev_input = signal[j];
+			state.prev_output = output;
+
+			signal[j] = (int16_t)(output * detail::AMPLIFIER_GAIN * 256);
+		}
+	}
+};
+
+/*
+Equivalent of vrc7_filter_lagrange_point_fast.
+*/
+struct FilterLagrangePointFast {
+	static void apply(int16_t *signal, const FilterCoeffs &coeffs, FilterState &state) {
+		int16_t sum = 0;
+		for (int j = 0; j < VRC7_SIGNAL_CHUNK_LENGTH; j++) {
+			sum += signal[j];
+		}
+
+		float output = state.prev_input * coeffs.fir_fast
+			+ sum * coeffs.fir_fast
+			+ state.prev_output * coeffs.iir_fast;
+		state.prev_input = sum;
+		state.prev_output = output;
+
+		output = (float)(output * detail::AMPLIFIER_GAIN * 3.35);
+		for (int j = 0; j < VRC7_SIGNAL_CHUNK_LENGTH; j++) {
+			signal[j] = (int16_t)output;
+		}
+	}
+};
+
+namespace detail {
+
+/*
+==================================================
+              TABLES & CONSTANTS
+==================================================
+*/
+
+//Same tables as in vrc7_sound.c. They are created once on first use.
+struct Tables {
+	uint32_t logsin[VRC7_LOGSIN_TABLE_LEN];
+	uint16_t fast_exp[VRC7_FAST_EXP_TABLE_LEN];
+	uint8_t env_inc_masks[VRC7_ENV_INC_INDEX_LEN];
+
+	Tables() {
+		vrc7_core_make_tables(logsin, fast_exp, env_inc_masks);
+	}
+};
+
+inline const Tables &tables() {
+	static const Tables t;
+	return t;
+}
+
+static const uint32_t RHYTHM_FIRST_CHANNEL = 6;
+static const uint32_t RHYTHM_KEY_BIT[3][2] = { {4,4}, {0,3}, {2,1} };
+
+inline bool bit_test(uint32_t value, uint32_t bit) {
+	return (value & (1u << bit)) != 0;
+}
+
+/*
+==================================================
+                 STATE & MIXING
+==================================================
+*/
+
+struct Slot {
+	int32_t sample;
+	int32_t sample_prev;
+	uint32_t phase;
+	uint32_t phase_inc;
+	uint32_t phase_step;
+	uint32_t tremolo_val;
+	uint32_t ksl_val;
+	uint32_t env_rate_high;
+	uint32_t env_rate_low;
+	uint32_t env_stage;
+	uint32_t env_value;
+	bool env_enabled;
+	bool restart_env;
+};
+
+struct Channel {
+	uint32_t instrument;
+	uint32_t fNum;
+	uint32_t octave;
+	uint32_t volume;
+	bool sustain;
+	bool trigger;
+	Slot slots[2];
+};
+
+/*
+Output stage. Both versions have the same channel_mask and stereo_volume members as vrc7_sound.
+*/
+template<bool Stereo, uint32_t Channels>
+struct Mix;
+
+template<uint32_t Channels>
+struct Mix<true, Channels> {
+	static const int NUM_SIDES = 2;
+
+	uint32_t channel_mask;
+	double stereo_volume[2][Channels];
+
+	void reset_mix() {
+		channel_mask = 0;
+		for (uint32_t i = 0; i < Channels; i++) {
+			stereo_volume[STEREO_LEFT][i] = 1.0;
+			stereo_volume[STEREO_RIGHT][i] = 1.0;
+		}
+	}
+
+	void mix(int16_t (*signal)[VRC7_SIGNAL_CHUNK_LENGTH], int pos, uint32_t ch, int32_t out) const {
+		if (!bit_test(channel_mask, ch)) {
+			signal[STEREO_LEFT][pos] = (int16_t)(out * stereo_volume[STEREO_LEFT][ch]);
+			signal[STEREO_RIGHT][pos] = (int16_t)(out * stereo_volume[STEREO_RIGHT][ch]);
+		}
+	}
+};
+
+template<uint32_t Channels>
+struct Mix<false, Channels> {
+	static const int NUM_SIDES = 1;
+
+	uint32_t channel_mask;
+	double stereo_volume[2][Channels];
+
+	void reset_mix() {
+		channel_mask = 0;
+		for (uint32_t i = 0; i < Channels; i++) {
+			stereo_volume[STEREO_LEFT][i] = 1.0;
+			stereo_volume[STEREO_RIGHT][i] = 1.0;
+		}
+	}
+
+	//Same gain as the mono configuration of vrc7_sound.c
+	void mix(int16_t (*signal)[VRC7_SIGNAL_CHUNK_LENGTH], int pos, uint32_t ch, int32_t out) const {
+		if (!bit_test(channel_mask, ch))
+			signal[0][pos] = (int16_t)(out * ((stereo_volume[STEREO_LEFT][ch] + stereo_volume[STEREO_RIGHT][ch]) / 2));
+	}
+};
+
+}
+
+/*
+==================================================
+                     ENGINE
+==================================================
+*/
+
+template<typename FilterPolicy, bool TestReg = false, uint32_t Channels = VRC7_NUM_CHANNELS, bool Stereo = true>
+class Chip : public detail::Mix<Stereo, Channels> {
+	static_assert(Channels == VRC7_NUM_CHANNELS || Channels == VRC7_MAX_CHANNELS, "Channels must be VRC7_NUM_CHANNELS (VRC7) or VRC7_MAX_CHANNELS (YM2413)");
+
+	typedef detail::Mix<Stereo, Channels> MixBase;
+
+public:
+	//The YM2413 configuration has rhythm mode and the noise generator
+	static const bool YM2413 = Channels == VRC7_MAX_CHANNELS;
+	static const int NUM_SIDES = MixBase::NUM_SIDES;
+
+	Chip() : MixBase(), channels_(), user_patch_(), user_derived_(), bank_(nullptr), signal_() {
+		detail::tables();
+		reset();
+	}
+
+	/*
+	Equivalent of vrc7_reset.
+	*/
+	void reset() {
+		set_patch_set(YM2413 ? OPLL_2413_TONE : VRC7_NUKE_TONE);
+		rhythm_ = false;
+		rhythm_keys_ = 0;
+		noise_ = 1;
+		set_clock_rate(VRC7_DEFAULT_CLOCK_RATE);
+		set_sample_rate(VRC7_DEFAULT_SAMPLE_RATE);
+		vibrato_counter_ = 0;
+		tremolo_value_ = 0;
+		tremolo_inc_ = 1;
+		envelope_counter_ = 0;
+		zero_count_ = 0;
+		mini_counter_ = 0;
+		address_ = 0x00;
+		test_envelope_ = test_reset_fmam_ = test_halt_phase_ = test_counters_ = false;
+		this->reset_mix();
+
+		for (int i = 0; i < MixBase::NUM_SIDES; i++) {
+			filter_state_[i].prev_input = 0.0f;
+			filter_state_[i].prev_output = 0.0f;
+		}
+
+		for (uint32_t i = 0; i < Channels; i++) {
+			detail::Channel &channel = channels_[i];
+			channel.fNum = 0;
+			channel.octave = 0;
+			channel.volume = 0;
+			channel.instrument = 0;
+			channel.sustain = false;
+			channel.trigger = false;
+			for (int type = 0; type < 2; type++) {
+				detail::Slot &slot = channel.slots[type];
+				slot = detail::Slot();
+				slot.env_stage = VRC7_ENV_DAMPING;
+				slot.env_value = 0x7f;
+			}
+		}
+		update_lfo();
+	}
+
+	/*
+	Equivalent of vrc7_clear.
+	*/
+	void clear() {
+		unsigned char empty[8] = { 0,0,0,0,0,0,0,0 };
+		vrc7_reg_to_patch(empty, &user_patch_);
+		vrc7_derive_patch(&user_patch_, &user_derived_);
+		user_tone_dirty_ = false;
+
+		tremolo_value_ = 0;
+		tremolo_inc_ = 1;
+		mini_counter_ = 0;
+		rhythm_ = false;
+		rhythm_keys_ = 0;
+		test_envelope_ = test_reset_fmam_ = test_halt_phase_ = test_counters_ = false;
+
+		for (uint32_t i = 0; i < Channels; i++) {
+			channels_[i].fNum = 0;
+			channels_[i].octave = 0;
+			channels_[i].volume = 0;
+			set_instrument(i, 0);
+
+			for (int type = 0; type < 2; type++) {
+				detail::Slot &slot = channels_[i].slots[type];
+				slot.env_stage = VRC7_ENV_DAMPING;
+				slot.env_value = 0;
+				slot.env_rate_high = 0;
+				slot.env_rate_low = 0;
+			}
+		}
+		update_lfo();
+	}
+
+	/*
+	Equivalent of vrc7_set_clock_rate.
+	*/
+	void set_clock_rate(double clock_rate) {
+		clock_rate_ = clock_rate;
+		double alpha1 = 27000.0 + 33000.0;
+		double alpha2 = 0.0047 * 27.0 * 33.0 * 2.0 * clock_rate;
+		double alpha2_fast = 0.0047 * 27.0 * 33.0 * 2.0 * clock_rate / 72.0;
+
+		coeffs_.fir = (float)(33000.0 / (alpha1 + alpha2));
+		coeffs_.iir = (float)(-(alpha1 - alpha2) / (alpha1 + alpha2));
+		coeffs_.fir_fast = (float)(33000.0 / (alpha1 + alpha2_fast));
+		coeffs_.iir_fast = (float)(-(alpha1 - alpha2_fast) / (alpha1 + alpha2_fast));
+	}
+
+	/*
+	Equivalent of vrc7_set_sample_rate.
+	*/
+	void set_sample_rate(double sample_rate) {
+		sample_rate_ = sample_rate;
+		sample_length_ = clock_rate_ / sample_rate;
+		current_time_ = 0.0f;
+	}
+
+	/*
+	Equivalent of vrc7_set_patch_set.
+	*/
+	void set_patch_set(int set) {
+		set_patch_bank(vrc7_get_patch_bank(set));
+	}
+
+	/*
+	Equivalent of vrc7_set_patch_bank. The bank is not copied and has to stay valid while it is used.
+	*/
+	void set_patch_bank(const struct vrc7_patch_bank *bank) {
+		user_patch_ = bank->patches[0];
+		user_derived_ = bank->derived[0];
+		user_tone_dirty_ = false;
+		bank_ = bank;
+
+		for (uint32_t i = 0; i < Channels; i++) {
+			set_instrument(i, channels_[i].instrument);
+		}
+	}
+
+	/*
+	Equivalent of vrc7_tick. The output is available through signal() afterwards.
+	*/
+	void tick() {
+		if (user_tone_dirty_ || dirty_channels_)
+			update_dirty();
+
+		std::memset(signal_, 0, sizeof(signal_));
+
+		//Same order as TYPE_SCHEDULE and CHANNEL_SCHEDULE in vrc7_sound.c
+		step<1, MODULATOR, 0>();
+		step<2, MODULATOR, 1>();
+		step<0, CARRIER, 2>();
+		step<1, CARRIER, 3>();
+		step<2, CARRIER, 4>();
+		step<3, MODULATOR, 5>();
+		step<4, MODULATOR, 6>();
+		step<5, MODULATOR, 7>();
+		step<3, CARRIER, 8>();
+		step<4, CARRIER, 9>();
+		step<5, CARRIER, 10>();
+		step<6, MODULATOR, 11>();
+		step<7, MODULATOR, 12>();
+		step<8, MODULATOR, 13>();
+		step<6, CARRIER, 14>();
+		step<7, CARRIER, 15>();
+		step<8, CARRIER, 16>();
+		step<0, MODULATOR, 17>();
+
+		//Update rhythm noise generator
+		if (YM2413) {
+			uint32_t noise_bit = ((noise_ >> 14) ^ noise_) & 1;
+			noise_ = (noise_ >> 1) | (noise_bit << 22);
+		}
+
+		for (int i = 0; i < MixBase::NUM_SIDES; i++) {
+			FilterPolicy::apply(signal_[i], coeffs_, filter_state_[i]);
+		}
+	}
+
+	/*
+	Equivalent of vrc7_fetch_sample. Writes NUM_SIDES values into sample.
+	*/
+	void fetch_sample(int16_t *sample) {
+		while (current_time_ >= VRC7_SIGNAL_CHUNK_LENGTH) {
+			tick();
+			current_time_ -= VRC7_SIGNAL_CHUNK_LENGTH;
+		}
+
+		int index = (int)current_time_;
+		for (int i = 0; i < MixBase::NUM_SIDES; i++) {
+			sample[i] = signal_[i][index];
+		}
+		current_time_ += sample_length_;
+	}
+
+	/*
+	Output of the last tick, see the signal property of vrc7_sound. The mono configuration only has side 0.
+	*/
+	const int16_t *signal(int side) const {
+		return signal_[side];
+	}
+
+	/*
+	Equivalent of vrc7_write_addr.
+	*/
+	void write_addr(uint32_t addr) {
+		address_ = addr;
+	}
+
+	/*
+	Equivalent of vrc7_write_data.
+	*/
+	void write_data(uint32_t data) {
+		uint32_t channel_num = address_ & 0x0f;
+		vrc7_patch &user_tone = user_patch_;
+
+		if (TestReg && test_counters_) {
+			if (detail::bit_test(data, 2))
+				envelope_counter_ = 0xffff;
+			else
+				envelope_counter_ = 0;
+		}
+
+		switch (address_) {
+		case 0x00:
+		case 0x01: {
+			int type = address_ == 0x00 ? MODULATOR : CARRIER;
+			user_tone.mult[type] = data & 0x0f;
+			user_tone.key_scale_rate[type] = detail::bit_test(data, 4);
+			user_tone.sustained[type] = detail::bit_test(data, 5);
+			user_tone.vibrato[type] = detail::bit_test(data, 6);
+			user_tone.tremolo[type] = detail::bit_test(data, 7);
+			user_tone_dirty_ = true;
+			break;
+		}
+		case 0x02:
+			user_tone.total_level = data & 0x3f;
+			user_tone.key_scale_level[MODULATOR] = data >> 6;
+			user_tone_dirty_ = true;
+			break;
+		case 0x03:
+			user_tone.feedback = data & 0x07;
+			user_tone.rect[MODULATOR] = detail::bit_test(data, 3);
+			user_tone.rect[CARRIER] = detail::bit_test(data, 4);
+			user_tone.key_scale_level[CARRIER] = data >> 6;
+			user_tone_dirty_ = true;
+			break;
+		case 0x04:
+		case 0x05: {
+			int type = address_ == 0x04 ? MODULATOR : CARRIER;
+			user_tone.attack_rate[type] = data >> 4;
+			user_tone.decay_rate[type] = data & 0x0f;
+			user_tone_dirty_ = true;
+			break;
+		}
+		case 0x06:
+		case 0x07: {
+			int type = address_ == 0x06 ? MODULATOR : CARRIER;
+			user_tone.sustain_level[type] = data >> 4;
+			user_tone.release_rate[type] = data & 0x0f;
+			user_tone_dirty_ = true;
+			break;
+		}
+		case 0x0f:	//Test register
+			if (TestReg) {
+				test_envelope_ = detail::bit_test(data, 0);
+				test_reset_fmam_ = detail::bit_test(data, 1);
+				test_halt_phase_ = detail::bit_test(data, 2);
+				test_counters_ = detail::bit_test(data, 3);
+			}
+			break;
+		case 0x0e:	//Rhythm control, YM2413 only
+			if (YM2413) {
+				bool prev_keys[3][2];
+				for (uint32_t i = 0; i < 3; i++) {
+					prev_keys[i][MODULATOR] = get_slot_key(detail::RHYTHM_FIRST_CHANNEL + i, MODULATOR);
+					prev_keys[i][CARRIER] = get_slot_key(detail::RHYTHM_FIRST_CHANNEL + i, CARRIER);
+				}
+
+				rhythm_ = detail::bit_test(data, 5);
+				rhythm_keys_ = data & 0x1f;
+
+				for (uint32_t i = 0; i < 3; i++) {
+					update_keys(detail::RHYTHM_FIRST_CHANNEL + i, prev_keys[i]);
+				}
+				dirty_channels_ |= 0x7 << detail::RHYTHM_FIRST_CHANNEL;
+			}
+			break;
+		default: {
+			if (channel_num >= Channels)
+				return;
+
+			detail::Channel &channel = channels_[channel_num];
+
+			if ((address_ & 0xf0) == 0x10) {			//Fnum
+				channel.fNum = (channel.fNum & 0x100) + data;
+				dirty_channels_ |= 1 << channel_num;
+			}
+			else if ((address_ & 0xf0) == 0x20) {	//Octave/sustain/trigger
+				bool prev_keys[2];
+				prev_keys[MODULATOR] = get_slot_key(channel_num, MODULATOR);
+				prev_keys[CARRIER] = get_slot_key(channel_num, CARRIER);
+				channel.fNum = (channel.fNum & 0xff) + ((data & 0x01) << 8);
+				channel.trigger = detail::bit_test(data, 4);
+				channel.sustain = detail::bit_test(data, 5);
+				update_keys(channel_num, prev_keys);
+				channel.octave = (data >> 1) & 0x07;
+				dirty_channels_ |= 1 << channel_num;
+			}
+			else if ((address_ & 0xf0) == 0x30) {	//Instrument/volume
+				channel.volume = data & 0x0f;
+				channel.instrument = data >> 4;
+				dirty_channels_ |= 1 << channel_num;
+			}
+		}
+		}
+	}
+
+	/*
+	Equivalent of vrc7_write_batch.
+	*/
+	void write_batch(const struct vrc7_write *writes, size_t count) {
+		for (size_t i = 0; i < count; i++) {
+			address_ = writes[i].addr;
+			write_data(writes[i].data);
+		}
+	}
+
+private:
+	/*
+	==================  Patches  ==================
+	*/
+
+	uint32_t get_patch_index(uint32_t ch) const {
+		if (YM2413 && rhythm_ && ch >= detail::RHYTHM_FIRST_CHANNEL)
+			return VRC7_NUM_PATCHES + ch - detail::RHYTHM_FIRST_CHANNEL;
+		return channels_[ch].instrument;
+	}
+
+	const vrc7_patch &patch(uint32_t index) const {
+		return index == 0 ? user_patch_ : bank_->patches[index];
+	}
+
+	const vrc7_patch_derived &derived(uint32_t index) const {
+		return index == 0 ? user_derived_ : bank_->derived[index];
+	}
+
+	bool get_slot_key(uint32_t ch, uint32_t type) const {
+		return channels_[ch].trigger
+			|| (YM2413 && rhythm_ && ch >= detail::RHYTHM_FIRST_CHANNEL
+				&& detail::bit_test(rhythm_keys_, detail::RHYTHM_KEY_BIT[ch - detail::RHYTHM_FIRST_CHANNEL][type]));
+	}
+
+	void update_keys(uint32_t ch, const bool *prev_keys) {
+		for (uint32_t type = 0; type < 2; type++) {
+			if (!prev_keys[type] && get_slot_key(ch, type))
+				channels_[ch].slots[type].restart_env = true;
+		}
+	}
+
+	uint32_t calc_envelope_rate_high(uint32_t ch, uint32_t type, uint32_t env_stage) const {
+		const detail::Channel &channel = channels_[ch];
+		uint32_t patch_index = get_patch_index(ch);
+		return vrc7_core_envelope_rate_high(&patch(patch_index), type, derived(patch_index).key_scale[type][channel.octave],
+			env_stage, get_slot_key(ch, type), channel.sustain);
+	}
+
+	void set_instrument(uint32_t ch, uint32_t instrument) {
+		detail::Channel &channel = channels_[ch];
+		channel.instrument = instrument;
+
+		const vrc7_patch_derived &d = derived(get_patch_index(ch));
+		uint32_t key_ksl = (channel.octave << 4) | (channel.fNum >> 5);
+		uint32_t key_rate = (channel.octave << 1) | (channel.fNum >> 8);
+		for (uint32_t type = 0; type < 2; type++) {
+			detail::Slot &slot = channel.slots[type];
+			slot.phase_inc = ((channel.fNum << (channel.octave + 2)) * d.mult_x8[type]) >> 3;
+			slot.ksl_val = d.ksl[type][key_ksl];
+			slot.env_rate_low = d.rate_low[type][key_rate];
+			slot.env_rate_high = calc_envelope_rate_high(ch, type, slot.env_stage);
+		}
+		update_channel_lfo(ch);
+	}
+
+	void update_dirty() {
+		if (user_tone_dirty_) {
+			user_tone_dirty_ = false;
+			vrc7_derive_patch(&user_patch_, &user_derived_);
+			for (uint32_t i = 0; i < Channels; i++) {
+				if (get_patch_index(i) == 0)
+					dirty_channels_ |= 1 << i;
+			}
+		}
+
+		for (uint32_t i = 0; i < Channels; i++) {
+			if (detail::bit_test(dirty_channels_, i))
+				set_instrument(i, channels_[i].instrument);
+		}
+		dirty_channels_ = 0;
+	}
+
+	/*
+	==================  Emulation  ==================
+	*/
+
+	template<uint32_t CH, uint32_t TYPE, int POS>
+	void step() {
+		run_slot<CH, TYPE, POS>(std::integral_constant<bool, (CH < Channels)>());
+
+		if (TestReg && test_counters_) {
+			update_fmam();
+		}
+		else if (POS == 16) {
+			update_fmam();
+			update_envelope_counters();
+		}
+
+		if (TestReg && test_halt_phase_)
+			halt_phase<CH, TYPE>(std::integral_constant<bool, (CH < Channels)>());
+	}
+
+	template<uint32_t CH, uint32_t TYPE, int POS>
+	void run_slot(std::false_type) {}
+
+	template<uint32_t CH, uint32_t TYPE, int POS>
+	void run_slot(std::true_type) {
+		int32_t val = update_slot<CH, TYPE>();
+
+		//Carriers produce output. In rhythm mode, the modulators of HH and TOM do as well.
+		bool rhythm = YM2413 && CH >= detail::RHYTHM_FIRST_CHANNEL && rhythm_;
+		if (TYPE == CARRIER || (rhythm && CH > detail::RHYTHM_FIRST_CHANNEL)) {
+			int32_t out = val >> 3;
+			if (rhythm)
+				out *= 2;
+			this->mix(signal_, POS * 4, CH, out);
+		}
+	}
+
+	template<uint32_t CH, uint32_t TYPE>
+	void halt_phase(std::false_type) {}
+
+	template<uint32_t CH, uint32_t TYPE>
+	void halt_phase(std::true_type) {
+		channels_[CH].slots[TYPE].phase = 0;
+	}
+
+	uint32_t calc_rhythm_phase(uint32_t ch, uint32_t type) const {
+		return vrc7_core_rhythm_phase(channels_[7].slots[MODULATOR].phase, channels_[8].slots[CARRIER].phase, noise_, ch, type);
+	}
+
+	void set_envelope_stage(uint32_t ch, uint32_t type, uint32_t stage) {
+		detail::Slot &slot = channels_[ch].slots[type];
+		slot.env_stage = stage;
+		slot.env_rate_high = calc_envelope_rate_high(ch, type, stage);
+	}
+
+	template<uint32_t CH, uint32_t TYPE>
+	void update_envelope() {
+		const vrc7_patch &p = patch(get_patch_index(CH));
+		detail::Slot &slot = channels_[CH].slots[TYPE];
+
+		uint32_t rate_high = slot.env_rate_high;
+		bool env_enabled = slot.env_enabled;
+
+		uint32_t env_inc = vrc7_core_envelope_inc(detail::tables().env_inc_masks, rate_high, slot.env_rate_low, slot.env_stage, slot.env_value, env_enabled,
+			zero_count_, envelope_counter_, mini_counter_);
+		uint32_t env_value = (slot.env_value + env_inc) & 0x7f;
+
+		bool rhythm_output = YM2413 && CH > detail::RHYTHM_FIRST_CHANNEL && rhythm_;
+		bool hold = TYPE == MODULATOR && p.sustained[MODULATOR] && !rhythm_output;
+		uint32_t env_stage = vrc7_core_envelope_stage(slot.env_stage, rate_high, &env_value, &env_enabled, slot.restart_env,
+			p.sustain_level[TYPE], get_slot_key(CH, TYPE), hold);
+		if (env_stage != slot.env_stage || slot.restart_env)
+			set_envelope_stage(CH, TYPE, env_stage);
+		slot.restart_env = false;
+
+		slot.env_value = env_value;
+		slot.env_enabled = env_enabled;
+	}
+
+	template<uint32_t CH, uint32_t TYPE>
+	int32_t update_slot() {
+		const detail::Tables &t = detail::tables();
+		detail::Channel &channel = channels_[CH];
+		uint32_t patch_index = get_patch_index(CH);
+		const vrc7_patch &p = patch(patch_index);
+		const vrc7_patch_derived &d = derived(patch_index);
+		detail::Slot &slot = channel.slots[TYPE];
+
+		bool rhythm_output = YM2413 && CH > detail::RHYTHM_FIRST_CHANNEL && rhythm_;
+
+		int32_t modulation = 0;
+		int volume = 0;
+		if (TYPE == CARRIER) {
+			if (!rhythm_output)
+				modulation = channel.slots[MODULATOR].sample << 1;
+			volume = channel.volume << 3;
+		}
+		else if (rhythm_output) {
+			volume = channel.instrument << 3;
+		}
+		else {
+			if (p.feedback != 0) {
+				modulation = (slot.sample + slot.sample_prev) >> 1;
+				modulation >>= d.feedback_shift;
+			}
+			volume = p.total_level << 1;
+		}
+
+		volume += slot.ksl_val;
+
+		volume += slot.tremolo_val;
+
+		update_envelope<CH, TYPE>();
+		if (!(TestReg && test_envelope_))
+			volume += slot.env_value;
+
+		volume = std::min(volume, 0x7f);
+
+		uint32_t phase = slot.phase;
+		if (rhythm_output && !(CH == 8 && TYPE == MODULATOR))
+			phase = calc_rhythm_phase(CH, TYPE) << 9;
+
+		int32_t output = vrc7_core_operator(t.logsin, t.fast_exp, phase, modulation, volume, p.rect[TYPE]);
+		if (slot.env_value == 0x7f)
+			output = 0;
+		slot.sample_prev = slot.sample;
+		slot.sample = output;
+
+		//Update operator phase
+		slot.phase += slot.phase_step;
+
+		return output;
+	}
+
+	void update_fmam() {
+		vrc7_core_update_fmam(&vibrato_counter_, &tremolo_value_, &tremolo_inc_);
+
+		if (TestReg && test_reset_fmam_) {
+			vibrato_counter_ = 0;
+			tremolo_value_ = 0;
+			tremolo_inc_ = 1;
+		}
+
+		if (get_lfo_step() != lfo_step_)
+			update_lfo();
+	}
+
+	/*
+	Same as update_channel_lfo in vrc7_sound.c.
+	*/
+	void update_channel_lfo(uint32_t ch) {
+		detail::Channel &channel = channels_[ch];
+		uint32_t patch_index = get_patch_index(ch);
+		const vrc7_patch &p = patch(patch_index);
+		const vrc7_patch_derived &d = derived(patch_index);
+
+		for (uint32_t type = 0; type < 2; type++) {
+			detail::Slot &slot = channel.slots[type];
+			int32_t vibrato_val = 0;
+			if (p.vibrato[type])
+				vibrato_val = vrc7_core_calc_vibrato(vibrato_counter_, channel.fNum, channel.octave);
+			slot.phase_step = slot.phase_inc + (((int32_t)d.mult_x8[type] * vibrato_val) >> 3);
+			slot.tremolo_val = p.tremolo[type] ? tremolo_value_ >> 3 : 0;
+		}
+	}
+
+	uint32_t get_lfo_step() const {
+		return vrc7_core_lfo_step(vibrato_counter_, tremolo_value_);
+	}
+
+	void update_lfo() {
+		lfo_step_ = get_lfo_step();
+		for (uint32_t i = 0; i < Channels; i++) {
+			update_channel_lfo(i);
+		}
+	}
+
+	void update_envelope_counters() {
+		vrc7_core_update_envelope_counters(&mini_counter_, &envelope_counter_, &zero_count_);
+	}
+
+	detail::Channel channels_[Channels];
+	vrc7_patch user_patch_;
+	vrc7_patch_derived user_derived_;
+	const struct vrc7_patch_bank *bank_;
+
+	double clock_rate_ = 0.0;
+	double sample_rate_ = 0.0;
+	double sample_length_ = 0.0;
+	double current_time_ = 0.0;
+	uint32_t vibrato_counter_ = 0;
+	uint32_t tremolo_value_ = 0;
+	int32_t tremolo_inc_ = 0;
+	uint32_t lfo_step_ = 0;
+	uint32_t envelope_counter_ = 0;
+	uint32_t zero_count_ = 0;
+	uint32_t mini_counter_ = 0;
+	uint32_t address_ = 0;
+	bool user_tone_dirty_ = false;
+	uint32_t dirty_channels_ = 0;
+	bool rhythm_ = false;
+	uint32_t rhythm_keys_ = 0;
+	uint32_t noise_ = 0;
+
+	bool test_envelope_ = false;
+	bool test_reset_fmam_ = false;
+	bool test_halt_phase_ = false;
+	bool test_counters_ = false;
+
+	FilterCoeffs coeffs_ = {};
+	FilterState filter_state_[MixBase::NUM_SIDES] = {};
+	int16_t signal_[MixBase::NUM_SIDES][VRC7_SIGNAL_CHUNK_LENGTH];
+};
+
+}
+
+#endif
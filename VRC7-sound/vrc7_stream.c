@@ -0,0 +1,131 @@
+/*
+Real-time streaming front end for vrc7_sound. See vrc7_stream.h.
+*/
+
+//clock_gettime is only declared for POSIX sources
+#if !defined(_WIN32) && !defined(_POSIX_C_SOURCE)
+#define _POSIX_C_SOURCE 200112L
+#endif
+
+#include "vrc7_stream.h"
+#include "vrc7_platform.h"
+
+#include <stdlib.h>
+
+static bool push_event(struct vrc7_stream *stream, uint64_t time, uint8_t type, uint8_t addr, uint8_t data) {
+	uint32_t write_index = stream->write_index;
+	uint32_t read_index = vrc7_atomic_load_acquire(&stream->read_index);
+
+	//Drop the event if the queue is full
+	if (write_index - read_index > stream->mask) {
+		vrc7_atomic_store_release(&stream->overflows, stream->overflows + 1);
+		return false;
+	}
+
+	struct vrc7_stream_event *event = &stream->events[write_index & stream->mask];
+	event->time = time;
+	event->type = type;
+	event->addr = addr;
+	event->data = data;
+
+	//Publish the event
+	vrc7_atomic_store_release(&stream->write_index, write_index + 1);
+	return true;
+}
+
+static inline uint64_t frame_time(struct vrc7_stream *stream, uint64_t frame) {
+	return (uint64_t)((double)frame * stream->clocks_per_frame);
+}
+
+VRC7SOUND_API struct vrc7_stream *vrc7_stream_new(struct vrc7_sound *vrc7_s, uint32_t capacity) {
+	//Round capacity up to a power of two so indices can be masked
+	uint32_t size = 1;
+	while (size < capacity && size < 0x80000000u)
+		size <<= 1;
+
+	struct vrc7_stream *stream = (struct vrc7_stream *) calloc(1, sizeof(struct vrc7_stream));
+	if (!stream)
+		return NULL;
+
+	stream->events = (struct vrc7_stream_event *) calloc(size, sizeof(struct vrc7_stream_event));
+	if (!stream->events) {
+		free(stream);
+		return NULL;
+	}
+
+	stream->vrc7_s = vrc7_s;
+	stream->mask = size - 1;
+	stream->clocks_per_frame = vrc7_s->clock_rate / vrc7_s->sample_rate;
+	stream->stats.min_latency = INT64_MAX;
+	return stream;
+}
+
+VRC7SOUND_API void vrc7_stream_delete(struct vrc7_stream *stream) {
+	free(stream->events);
+	free(stream);
+}
+
+VRC7SOUND_API bool vrc7_stream_write(struct vrc7_stream *stream, uint64_t time, uint8_t addr, uint8_t data) {
+	return push_event(stream, time, VRC7_STREAM_WRITE, addr, data);
+}
+
+VRC7SOUND_API bool vrc7_stream_advance(struct vrc7_stream *stream, uint64_t time) {
+	return push_event(stream, time, VRC7_STREAM_ADVANCE, 0, 0);
+}
+
+VRC7SOUND_API void vrc7_stream_render(struct vrc7_stream *stream, int16_t *out, uint32_t frames) {
+	struct vrc7_stream_stats *stats = &stream->stats;
+	uint32_t read_index = stream->read_index;
+	uint32_t write_index = vrc7_atomic_load_acquire(&stream->write_index);
+
+	//Events are queued in order, so the newest one tells how far the producer is
+	uint64_t horizon = read_index != write_index ? stream->events[(write_index - 1) & stream->mask].time : stream->horizon;
+	stats->latency = (int64_t)(horizon - frame_time(stream, stats->frames));
+	if (stats->latency < stats->min_latency)
+		stats->min_latency = stats->latency;
+
+	bool underrun = false;
+	for (uint32_t i = 0; i < frames; i++) {
+		uint64_t time = frame_time(stream, stats->frames);
+
+		//Apply all events that are due
+		if (read_index == write_index)
+			write_index = vrc7_atomic_load_acquire(&stream->write_index);
+		if (read_index != write_index) {
+			while (read_index != write_index && stream->events[read_index & stream->mask].time <= time) {
+				const struct vrc7_stream_event *event = &stream->events[read_index & stream->mask];
+				if (event->type == VRC7_STREAM_WRITE) {
+					if (stats->frames > 0 && event->time <= stream->prev_time)
+						stats->late_writes++;
+					vrc7_write_addr(stream->vrc7_s, event->addr);
+					vrc7_write_data(stream->vrc7_s, event->data);
+				}
+				stream->horizon = event->time;
+				read_index++;
+			}
+
+			//Give the slots back to the producer
+			vrc7_atomic_store_release(&stream->read_index, read_index);
+		}
+
+		//Nothing queued for this frame and the producer has not announced it yet
+		if (read_index == write_index && stream->horizon < time) {
+			stats->underrun_frames++;
+			underrun = true;
+		}
+
+		if (stream->vrc7_s->mono_output) {
+			int16_t sample[2];
+			vrc7_fetch_sample(stream->vrc7_s, sample);
+			out[i] = sample[STEREO_LEFT];
+		} else {
+			vrc7_fetch_sample(stream->vrc7_s, &out[i * 2]);
+		}
+		stream->prev_time = time;
+		stats->frames++;
+	}
+
+	if (underrun)
+		stats->underruns++;
+	stats->overflows = vrc7_atomic_load_acquire(&stream->overflows);
+}
@@ -0,0 +1,111 @@
+/*
+Real-time streaming front end for vrc7_sound.
+
+The emulation thread (producer) queues timestamped register writes, the audio thread (consumer) renders exactly the number of frames it
+needs and applies the writes when their time is reached. Both sides are wait-free: the producer never blocks on the audio thread and
+vrc7_stream_render neither locks nor allocates.
+
+Timestamps are given in clock cycles of the chip (see vrc7_set_clock_rate), counted from the creation of the stream. They must never
+decrease. The producer should call vrc7_stream_advance regularly, even when there are no writes, so the audio thread knows how far the
+emulation has progressed. Rendering past that point is counted as an underrun.
+
+Only one producer thread and one consumer thread may use a stream. The vrc7_sound object belongs to the consumer after vrc7_stream_new;
+set the clock and sample rate before creating the stream.
+*/
+
+#ifndef VRC7_STREAM_H
+#define VRC7_STREAM_H
+
+#include "vrc7_sound.h"
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+#define VRC7_STREAM_WRITE 0
+#define VRC7_STREAM_ADVANCE 1
+
+struct vrc7_stream_event {
+	uint64_t time;
+	uint8_t type;
+	uint8_t addr;
+	uint8_t data;
+};
+
+/*
+Statistics of a stream. They are updated by vrc7_stream_render and should be read on the audio thread.
+-- frames:				Number of frames rendered.
+-- underruns:			Number of render calls that rendered past the time announced by the producer.
+-- underrun_frames:		Number of frames rendered past the time announced by the producer.
+-- late_writes:			Number of writes that were applied after their time had already been rendered.
+-- overflows:			Number of events dropped because the queue was full.
+-- latency:				Time in clock cycles the producer was ahead of the audio at the start of the last render call. Negative during underruns.
+-- min_latency:			Smallest latency seen so far.
+*/
+struct vrc7_stream_stats {
+	uint64_t frames;
+	uint64_t underruns;
+	uint64_t underrun_frames;
+	uint64_t late_writes;
+	uint32_t overflows;
+	int64_t latency;
+	int64_t min_latency;
+};
+
+/*
+-- vrc7_s:		The chip rendered by the stream.
+-- stats:		See vrc7_stream_stats.
+*/
+struct vrc7_stream {
+	//Read only:
+	struct vrc7_sound *vrc7_s;
+	struct vrc7_stream_stats stats;
+
+	//private:
+	struct vrc7_stream_event *events;
+	uint32_t mask;
+	double clocks_per_frame;
+	uint64_t horizon;
+	uint64_t prev_time;
+
+	//Producer and consumer indices are kept on separate cache lines
+	uint8_t padding0[64];
+	volatile uint32_t write_index;
+	volatile uint32_t overflows;
+	uint8_t padding1[64];
+	volatile uint32_t read_index;
+	uint8_t padding2[64];
+};
+
+/*
+Creates a stream for vrc7_s. capacity is the number of events the queue can hold and is rounded up to a power of two.
+Returns NULL if the queue could not be allocated.
+*/
+VRC7SOUND_API struct vrc7_stream *vrc7_stream_new(struct vrc7_sound *vrc7_s, uint32_t capacity);
+
+/*
+Deletes a stream. The vrc7_sound object is not deleted.
+*/
+VRC7SOUND_API void vrc7_stream_delete(struct vrc7_stream *stream);
+
+/*
+Producer: queues a register write at the given time. Returns false if the queue is full and the write was dropped.
+*/
+VRC7SOUND_API bool vrc7_stream_write(struct vrc7_stream *stream, uint64_t time, uint8_t addr, uint8_t data);
+
+/*
+Producer: announces that all writes up to the given time have been queued. Returns false if the queue is full.
+*/
+VRC7SOUND_API bool vrc7_stream_advance(struct vrc7_stream *stream, uint64_t time);
+
+/*
+Consumer: renders exactly frames interleaved stereo frames into out, applying all writes that are due before each frame.
+If mono_output of the chip is set, every frame is a single sample (the left side), like with vrc7_run_clocks.
+*/
+VRC7SOUND_API void vrc7_stream_render(struct vrc7_stream *stream, int16_t *out, uint32_t frames);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif
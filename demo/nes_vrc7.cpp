@@ -20,6 +20,8 @@ namespace xgm
   NES_VRC7::~NES_VRC7 ()
   {
     vrc7_delete (vrc7_s);
+    if (patch_custom)
+      vrc7_patch_bank_delete (patch_custom);
   }
 
   void NES_VRC7::UseAllChannels(bool b)
@@ -34,7 +36,15 @@ namespace xgm
 
   void NES_VRC7::SetPatchSetCustom (const UINT8* pset)
   {
-    patch_custom = pset;
+    if (patch_custom)
+    {
+      // make sure the old bank is no longer referenced before deleting it
+      vrc7_set_patch_set(vrc7_s, patch_set);
+      vrc7_patch_bank_delete(patch_custom);
+      patch_custom = NULL;
+    }
+    if (pset)
+      patch_custom = vrc7_patch_bank_from_memory(pset, 16 * 19);
   }
 
   void NES_VRC7::SetClock (double c)
@@ -51,11 +61,11 @@ namespace xgm
 
   void NES_VRC7::Reset ()
   {
-	  vrc7_reset(vrc7_s);
+	  // YM2413 mode enables channels 6-8 and rhythm, this also resets the chip
+	  vrc7_set_chip_type(vrc7_s, use_all_channels ? VRC7_CHIP_YM2413 : VRC7_CHIP_VRC7);
 
-	divider = 0;
 	if (patch_custom)
-		vrc7_set_patch_set(vrc7_s, (int) patch_custom);
+		vrc7_set_patch_bank(vrc7_s, patch_custom);
 	else
 		vrc7_set_patch_set(vrc7_s, patch_set);
   }
@@ -64,7 +74,7 @@ namespace xgm
   {
       if (trk < 0) return;
       //if (trk > 5) return;
-      if (trk >= VRC7_NUM_CHANNELS) return; 
+      if (trk >= VRC7_MAX_CHANNELS) return; 
       sm[0][trk] = mixl;
       sm[1][trk] = mixr;
 	  vrc7_s->stereo_volume[STEREO_LEFT][trk] = (double)mixl / 128;
@@ -73,7 +83,7 @@ namespace xgm
 
   ITrackInfo *NES_VRC7::GetTrackInfo(int trk)
   {
-    if(vrc7_s && trk<VRC7_NUM_CHANNELS)
+    if(vrc7_s && trk<(int)vrc7_s->num_channels)
     {
 		
       trkinfo[trk].max_volume = 15;
@@ -113,12 +123,8 @@ namespace xgm
 
   void NES_VRC7::Tick (UINT32 clocks)
   {
-    divider += clocks;
-    while (divider >= 36)
-    {
-        divider -= 36;
-        vrc7_tick(vrc7_s);
-    }
+    // the core keeps the remainder of clocks that do not make up a whole tick
+    vrc7_run_clocks(vrc7_s, clocks, NULL, 0);
   }
 
   UINT32 NES_VRC7::Render (INT32 b[2])
@@ -11,12 +11,11 @@ namespace xgm
   protected:
     int mask;
     int patch_set;
-    const UINT8* patch_custom;
+    struct vrc7_patch_bank *patch_custom;
     //INT32 sm[2][6]; // stereo mix
     INT32 sm[2][9]; // stereo mix temporary HACK to support YM2413
     INT16 buf[2];
     struct vrc7_sound *vrc7_s;
-    UINT32 divider; // clock divider
     double clock, rate;
     //TrackInfoBasic trkinfo[6];
     TrackInfoBasic trkinfo[9]; // HACK to support YM2413